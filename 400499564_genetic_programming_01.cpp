@@ -1,12 +1,33 @@
+#include <fcntl.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <sstream>
 #include <stack>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "cartCentering.h"
+#include "controllerProgram.h"
 
 using namespace std;
 
@@ -49,6 +70,36 @@ bool isOp(string op)
     return false;
 }
 
+// return the opcode of a supported operation, otherwise OP_UNKNOWN
+Opcode opcodeOf(const string &op)
+{
+  if (op == "+")
+    return OP_ADD;
+  else if (op == "-")
+    return OP_SUB;
+  else if (op == "*")
+    return OP_MUL;
+  else if (op == "/")
+    return OP_DIV;
+  else if (op == ">")
+    return OP_GT;
+  else if (op == "abs")
+    return OP_ABS;
+  else if (op == "read")
+    return OP_READ;
+  else if (op == "write")
+    return OP_WRITE;
+  else
+    return OP_UNKNOWN;
+}
+
+// return the text of an opcode as it appears in a tree
+string opName(Opcode op)
+{
+  static const char *names[] = {"+", "-", "*", "/", ">", "abs", "read", "write", "a", "b", "const", "?"};
+  return names[op];
+}
+
 int arity(string op)
 {
   if (op == "abs")
@@ -67,23 +118,33 @@ int arity(string op)
 
 typedef string Elem;
 
+// how a tree was made
+enum Origin
+{
+  BORN_RANDOM,
+  BORN_MUTATION,
+  BORN_CROSSOVER,
+  BORN_ENUMERATED
+};
+
 class LinkedBinaryTree
 {
 public:
+  // nodes are shared between trees and reference counted: copying a tree only
+  // copies its root pointer, and a node reachable from more than one place is
+  // never modified. Mutations copy the nodes on the path from the root to the
+  // changed subtree (see makeUnique) and share everything else. The count is
+  // atomic so that copies of a tree can be used and mutated in different threads.
   struct Node
   {
     Elem elt;
     string name;
-    Node *par;
     Node *left;
     Node *right;
-    Node() : elt(), par(NULL), name(""), left(NULL), right(NULL) {}
-    int depth()
-    {
-      if (par == NULL)
-        return 0;
-      return par->depth() + 1;
-    }
+    bool constant; // numeric leaf whose value is already parsed into value
+    double value;
+    mutable atomic<int> refs; // number of trees and parent nodes pointing to this node
+    Node() : elt(), name(""), left(NULL), right(NULL), constant(false), value(0), refs(1) {}
   };
 
   class Position
@@ -93,19 +154,9 @@ public:
 
   public:
     Position(Node *_v = NULL) : v(_v) {}
-    Elem &operator*() { return v->elt; }
+    const Elem &operator*() const { return v->elt; }
     Position left() const { return Position(v->left); }
-    void setLeft(Node *n) { v->left = n; }
     Position right() const { return Position(v->right); }
-    void setRight(Node *n) { v->right = n; }
-    Position parent() const // get parent
-    {
-      return Position(v->par);
-    }
-    bool isRoot() const // root of the tree?
-    {
-      return v->par == NULL;
-    }
     bool isExternal() const // an external node?
     {
       return v->left == NULL && v->right == NULL;
@@ -114,64 +165,78 @@ public:
   };
   typedef vector<Position> PositionList;
 
+  // a node reached from the root, as listed by slots()
+  struct Slot
+  {
+    Node *v;
+    int parent; // index of the parent's slot, -1 for the root
+    bool left;  // v is the left child of its parent
+    int depth;
+  };
+  typedef vector<Slot> SlotList;
+
 public:
-  LinkedBinaryTree() : _root(NULL), score(0), steps(0), generation(0)
+  LinkedBinaryTree() : _root(NULL), score(0), steps(0), generation(0), id(-1),
+                       parent1(-1), parent2(-1), origin(BORN_RANDOM)
   {
-    memory = vector<double>(4, 0.0);
+    memory = vector<double>(MEMORY_CELLS, 0.0);
   }
 
-  // copy constructor
+  // copy constructor, shares the nodes of t
   LinkedBinaryTree(const LinkedBinaryTree &t)
   {
-    _root = copyPreOrder(t.root());
+    _root = retain(t.root());
     score = t.getScore();
     steps = t.getSteps();
     generation = t.getGeneration();
     memory = t.memory;
+    id = t.id;
+    parent1 = t.parent1;
+    parent2 = t.parent2;
+    origin = t.origin;
   }
 
-  // copy assignment operator
+  // copy assignment operator, shares the nodes of t
   LinkedBinaryTree &operator=(const LinkedBinaryTree &t)
   {
     if (this != &t)
     {
-      // if tree already contains data, delete it
-      if (_root != NULL)
-      {
-        PositionList pl = positions();
-        for (auto &p : pl)
-          delete p.v;
-      }
-      _root = copyPreOrder(t.root());
+      Node *old = _root;
+      _root = retain(t.root());
+      release(old);
       score = t.getScore();
       steps = t.getSteps();
       generation = t.getGeneration();
       memory = t.memory;
+      id = t.id;
+      parent1 = t.parent1;
+      parent2 = t.parent2;
+      origin = t.origin;
     }
     return *this;
   }
 
   // destructor
-  ~LinkedBinaryTree()
-  {
-    if (_root != NULL)
-    {
-      PositionList pl = positions();
-      for (auto &p : pl)
-        delete p.v;
-    }
-  }
+  ~LinkedBinaryTree() { release(_root); }
 
   int size() const { return size(_root); }
   int size(Node *root) const;
-  int depth() const;
+  int depth() const { return height(_root); }
+  int height(const Node *v) const;
   bool empty() const { return size() == 0; };
   Node *root() const { return _root; }
   PositionList positions() const;
-  void addRoot() { _root = new Node; }
-  void addRoot(Elem e)
+  SlotList slots(bool push_left_first) const;
+  Node *makeUnique(SlotList &sl, int i);
+  void replaceSubtree(SlotList &sl, int i, const Node *n);
+  void addRoot()
   {
+    release(_root);
     _root = new Node;
+  }
+  void addRoot(Elem e)
+  {
+    addRoot();
     _root->elt = e;
   }
   void nameRoot(string name) { _root->name = name; }
@@ -179,8 +244,9 @@ public:
   void addLeftChild(const Position &p);
   void addRightChild(const Position &p, const Node *n);
   void addRightChild(const Position &p);
-  void printExpression() { printExpression(_root); }
-  void printExpression(Node *v);
+  void printExpression() { printExpression(_root, cout); }
+  void printExpression(Node *v) { printExpression(v, cout); }
+  void printExpression(const Node *v, ostream &out) const;
   double evaluateExpression(double a, double b)
   {
     return evaluateExpression(Position(_root), a, b);
@@ -188,6 +254,18 @@ public:
   double evaluateExpression(const Position &p, double a, double b);
   long getGeneration() const { return generation; }
   void setGeneration(int g) { generation = g; }
+  long getId() const { return id; }
+  long getParent1() const { return parent1; }
+  long getParent2() const { return parent2; }
+  Origin getOrigin() const { return origin; }
+  // record that the tree with id i was made by origin from parents p1 and p2
+  void setBirth(long i, Origin o, long p1 = -1, long p2 = -1)
+  {
+    id = i;
+    origin = o;
+    parent1 = p1;
+    parent2 = p2;
+  }
   double getScore() const { return score; }
   void setScore(double s) { score = s; }
   double getSteps() const { return steps; }
@@ -199,14 +277,24 @@ public:
   }
   void deleteSubtreeMutator(mt19937 &rng);
   void addSubtreeMutator(mt19937 &rng, const int maxDepth, bool PARTIALLY_OBSERVABLE);
-  void clear(Node *v)
+  bool usesMemory() const;
+  // take a reference to the subtree at v
+  static Node *retain(const Node *v)
+  {
+    if (v != NULL)
+      v->refs++;
+    return const_cast<Node *>(v);
+  }
+  // drop a reference to the subtree at v, deleting the nodes no longer used
+  static void release(Node *v)
   {
-    if (v == nullptr)
+    if (v == NULL || --v->refs > 0)
       return;
-    clear(v->left);
-    clear(v->right);
+    release(v->left);
+    release(v->right);
     delete v;
   }
+  double *memoryCells() { return memory.data(); } // MEMORY_CELLS of them
   double getMemory() const
   {
     double sum = 0;
@@ -232,43 +320,47 @@ public:
 
 protected:                                        // local utilities
   void preorder(Node *v, PositionList &pl) const; // preorder utility
-  Node *copyPreOrder(const Node *root);
+  Node *shallowCopy(const Node *v);
   double score;    // mean reward over 20 episodes
   double steps;    // mean steps-per-episode over 20 episodes
   long generation; // which generation was tree "born"
+  long id;         // unique within a run, -1 if not assigned
+  long parent1;    // id of the tree it was made from, -1 if none
+  long parent2;    // id of the second parent of a crossover, -1 if none
+  Origin origin;   // operator that made the tree
 private:
   Node *_root; // pointer to the root
   vector<double> memory;
 };
 
-// add the tree rooted at node child as this tree's left child
+// add the tree rooted at node child as this tree's left child, sharing its nodes
 void LinkedBinaryTree::addLeftChild(const Position &p, const Node *child)
 {
   Node *v = p.v;
-  v->left = copyPreOrder(child); // deep copy child
-  v->left->par = v;
+  release(v->left);
+  v->left = retain(child);
 }
 
-// add the tree rooted at node child as this tree's right child
+// add the tree rooted at node child as this tree's right child, sharing its nodes
 void LinkedBinaryTree::addRightChild(const Position &p, const Node *child)
 {
   Node *v = p.v;
-  v->right = copyPreOrder(child); // deep copy child
-  v->right->par = v;
+  release(v->right);
+  v->right = retain(child);
 }
 
 void LinkedBinaryTree::addLeftChild(const Position &p)
 {
   Node *v = p.v;
+  release(v->left);
   v->left = new Node;
-  v->left->par = v;
 }
 
 void LinkedBinaryTree::addRightChild(const Position &p)
 {
   Node *v = p.v;
+  release(v->right);
   v->right = new Node;
-  v->right->par = v;
 }
 
 // return a list of all nodes
@@ -288,6 +380,73 @@ void LinkedBinaryTree::preorder(Node *v, PositionList &pl) const
     preorder(v->right, pl);
 }
 
+// return all nodes in the order a stack-based traversal pops them, together with
+// the path back to the root that makeUnique needs to modify them
+LinkedBinaryTree::SlotList LinkedBinaryTree::slots(bool push_left_first) const
+{
+  SlotList sl;
+  if (_root == NULL)
+    return sl;
+  stack<Slot> s;
+  s.push({_root, -1, false, 0});
+  while (!s.empty())
+  {
+    Slot cur = s.top();
+    s.pop();
+    int i = sl.size();
+    sl.push_back(cur);
+    Slot l = {cur.v->left, i, true, cur.depth + 1};
+    Slot r = {cur.v->right, i, false, cur.depth + 1};
+    if (push_left_first)
+    {
+      if (l.v != NULL)
+        s.push(l);
+      if (r.v != NULL)
+        s.push(r);
+    }
+    else
+    {
+      if (r.v != NULL)
+        s.push(r);
+      if (l.v != NULL)
+        s.push(l);
+    }
+  }
+  return sl;
+}
+
+// return the node of slot i after copying every shared node on its path from the
+// root, so that it can be modified without affecting other trees
+LinkedBinaryTree::Node *LinkedBinaryTree::makeUnique(SlotList &sl, int i)
+{
+  Slot &s = sl[i];
+  Node **link = &_root;
+  if (s.parent >= 0)
+  {
+    Node *par = makeUnique(sl, s.parent);
+    link = s.left ? &par->left : &par->right;
+  }
+  if ((*link)->refs > 1)
+  {
+    Node *copy = shallowCopy(*link);
+    release(*link);
+    *link = copy;
+  }
+  s.v = *link;
+  return s.v;
+}
+
+// replace the subtree of slot i (not the root) by the subtree at n
+void LinkedBinaryTree::replaceSubtree(SlotList &sl, int i, const Node *n)
+{
+  Node *par = makeUnique(sl, sl[i].parent);
+  Node *&link = sl[i].left ? par->left : par->right;
+  Node *old = link;
+  link = retain(n);
+  release(old);
+  sl[i].v = link;
+}
+
 int LinkedBinaryTree::size(Node *v) const
 {
   int lsize = 0;
@@ -299,31 +458,45 @@ int LinkedBinaryTree::size(Node *v) const
   return 1 + lsize + rsize;
 }
 
-int LinkedBinaryTree::depth() const
+// return the number of edges on the longest path from v down to a leaf
+int LinkedBinaryTree::height(const Node *v) const
 {
+  if (v == NULL)
+    return 0;
+  int h = 0;
+  if (v->left != NULL)
+    h = std::max(h, 1 + height(v->left));
+  if (v->right != NULL)
+    h = std::max(h, 1 + height(v->right));
+  return h;
+}
+
+// return true if the tree contains a read or write node, i.e. its output depends on past steps
+bool LinkedBinaryTree::usesMemory() const
+{
+  if (_root == NULL)
+    return false;
   PositionList pl = positions();
-  int depth = 0;
   for (auto &p : pl)
-    depth = std::max(depth, p.v->depth());
-  return depth;
+    if (p.v->elt == "read" || p.v->elt == "write")
+      return true;
+  return false;
 }
 
-LinkedBinaryTree::Node *LinkedBinaryTree::copyPreOrder(const Node *root)
+// return a new node with the contents of v that shares v's children
+LinkedBinaryTree::Node *LinkedBinaryTree::shallowCopy(const Node *v)
 {
-  if (root == NULL)
-    return NULL;
   Node *nn = new Node;
-  nn->elt = root->elt;
-  nn->left = copyPreOrder(root->left);
-  if (nn->left != NULL)
-    nn->left->par = nn;
-  nn->right = copyPreOrder(root->right);
-  if (nn->right != NULL)
-    nn->right->par = nn;
+  nn->elt = v->elt;
+  nn->name = v->name;
+  nn->constant = v->constant;
+  nn->value = v->value;
+  nn->left = retain(v->left);
+  nn->right = retain(v->right);
   return nn;
 }
 
-void LinkedBinaryTree::printExpression(Node *v)
+void LinkedBinaryTree::printExpression(const Node *v, ostream &out) const
 {
   if (v == nullptr)
   {
@@ -331,67 +504,42 @@ void LinkedBinaryTree::printExpression(Node *v)
   }
   if (v->left == nullptr && v->right == nullptr)
   {
-    cout << v->elt;
+    out << v->elt;
     return;
   }
   int opArity = arity(v->elt);
   if (opArity == 0)
   {
-    cout << v->elt;
+    out << v->elt;
     return;
   }
   else if (opArity == 1)
   {
-    cout << v->elt << "(";
+    out << v->elt << "(";
     if (v->left)
     {
-      printExpression(v->left);
+      printExpression(v->left, out);
     }
-    cout << ")";
+    out << ")";
   }
   else if (opArity == 2)
   {
-    cout << "(";
-    printExpression(v->left);
-    cout << " " << v->elt << " ";
-    printExpression(v->right);
-    cout << ")";
+    out << "(";
+    printExpression(v->left, out);
+    out << " " << v->elt << " ";
+    printExpression(v->right, out);
+    out << ")";
   }
 }
 
+double evalOp(Opcode op, LinkedBinaryTree &theTree, double x, double y = 0)
+{
+  return applyOp(op, x, y, theTree.memoryCells());
+}
+
 double evalOp(string op, LinkedBinaryTree &theTree, double x, double y = 0)
 {
-  double result;
-  if (op == "+")
-    result = x + y;
-  else if (op == "-")
-    result = x - y;
-  else if (op == "*")
-    result = x * y;
-  else if (op == "/")
-  {
-    result = x / y;
-  }
-  else if (op == ">")
-  {
-    result = x > y ? 1 : -1;
-  }
-  else if (op == "abs")
-  {
-    result = abs(x);
-  }
-  else if (op == "read")
-  {
-    result = theTree.getMemory();
-  }
-  else if (op == "write")
-  {
-    theTree.setMemory(x);
-    result = x;
-  }
-  else
-    result = 0;
-  return isnan(result) || !isfinite(result) ? 0 : result;
+  return evalOp(opcodeOf(op), theTree, x, y);
 }
 
 double LinkedBinaryTree::evaluateExpression(const Position &p, double a,
@@ -412,6 +560,8 @@ double LinkedBinaryTree::evaluateExpression(const Position &p, double a,
   }
   else
   {
+    if (p.v->constant)
+      return p.v->value;
     if (p.v->elt == "a")
       return a;
     else if (p.v->elt == "b")
@@ -436,47 +586,21 @@ void LinkedBinaryTree::deleteSubtreeMutator(mt19937 &rng)
     cout << "The tree is empty" << endl;
     return;
   }
-  vector<Node *> candidates;
-  stack<Node *> s;
-  s.push(_root);
-  while (!s.empty()) // traverse the tree in post-order
-  {
-    Node *cur = s.top();
-    s.pop();
-    if (cur->par != nullptr)
-      candidates.push_back(cur);
-    if (cur->left != nullptr)
-      s.push(cur->left);
-    if (cur->right != nullptr)
-      s.push(cur->right);
-  }
+  SlotList sl = slots(true);
+  vector<int> candidates;
+  for (int i = 0; i < (int)sl.size(); i++)
+    if (sl[i].parent >= 0) // any node but the root
+      candidates.push_back(i);
   if (candidates.empty())
   {
     return;
   }
   int index = randInt(rng, 0, candidates.size() - 1); // randomly select a node to delete
-  Node *target = candidates[index];
-  Node *parent = target->par;
-  if (parent->left == target)
-  {
-    parent->left = nullptr;
-  }
-  else if (parent->right == target)
-  {
-    parent->right = nullptr;
-  }
-  clear(target);
+  int target = candidates[index];
   Node *newNode = new Node;
   newNode->elt = randChoice(rng) ? "a" : "b"; // increase the robustness of the tree
-  newNode->par = parent;
-  if (parent->left == nullptr)
-  {
-    parent->left = newNode;
-  }
-  else if (parent->right == nullptr)
-  {
-    parent->right = newNode;
-  }
+  replaceSubtree(sl, target, newNode);        // only copies the path to the root
+  release(newNode);
 }
 
 void LinkedBinaryTree::addSubtreeMutator(mt19937 &rng, const int maxDepth, bool PARTIALLY_OBSERVABLE)
@@ -487,48 +611,26 @@ void LinkedBinaryTree::addSubtreeMutator(mt19937 &rng, const int maxDepth, bool
     randomExpressionTree(_root, maxDepth, rng, PARTIALLY_OBSERVABLE);
     return;
   }
-  vector<Node *> leaves;
-  stack<Node *> nodeStack;
-  nodeStack.push(_root); // initialize the stack with the root node
-
-  while (!nodeStack.empty())
-  {
-    Node *current = nodeStack.top();
-    nodeStack.pop();
-
-    // check if the current node is a leaf node
-    if (current->left == nullptr && current->right == nullptr)
-    {
-      leaves.push_back(current);
-    }
-    else
-    {
-      // push the children of the current node to the stack
-      if (current->right != nullptr)
-      {
-        nodeStack.push(current->right);
-      }
-      if (current->left != nullptr)
-      {
-        nodeStack.push(current->left);
-      }
-    }
-  }
+  SlotList sl = slots(false);
+  vector<int> leaves;
+  for (int i = 0; i < (int)sl.size(); i++)
+    if (sl[i].v->left == nullptr && sl[i].v->right == nullptr)
+      leaves.push_back(i);
 
   if (leaves.empty())
     return;
 
   // random select a leaf node
   int idx = randInt(rng, 0, leaves.size() - 1);
-  Node *target = leaves[idx];
-  int d = target->depth();
+  int d = sl[leaves[idx]].depth;
   int depthAllowance = maxDepth - d;
   if (depthAllowance < 0)
   {
     depthAllowance = 0;
   }
 
-  // generate a random subtree
+  // generate a random subtree in a private copy of the leaf
+  Node *target = makeUnique(sl, leaves[idx]);
   randomExpressionTree(target, depthAllowance, rng, PARTIALLY_OBSERVABLE);
 }
 
@@ -571,91 +673,212 @@ LinkedBinaryTree createExpressionTree(string postfix)
   return tree_stack.top();
 }
 
-void LinkedBinaryTree::randomExpressionTree(Node *p, const int &maxDepth, mt19937 &rng, bool PARTIALLY_OBSERVABLE)
+// run work(begin, end, rng) for every chunk of chunk_size items of n on all cores.
+// Each chunk has its own rng seeded from (seed, generation, chunk), so the result
+// does not depend on the number of threads.
+template <typename Work>
+void forEachChunk(size_t n, size_t chunk_size, unsigned seed, int generation, Work work)
 {
-  double prob = randDouble(rng); // random number between 0 and 1
-  static const vector<string> terminals = {"a", "b"};
-  if (PARTIALLY_OBSERVABLE)
+  size_t chunks = (n + chunk_size - 1) / chunk_size;
+  atomic<size_t> next_chunk(0);
+  auto worker = [&]()
   {
-    static const vector<string> ops = {"+", "-", "*", "/", ">", "abs", "read", "write"};
-
-    // if get in the leaf from the recursion (base case), then create a leaf node
-    if (maxDepth == 0 || prob < 0.3) // when reaches the max depth or with 30% probability, generate the terminal node (leaf)
-    {
-      int index = randInt(rng, 0, terminals.size() - 1); // randomly select a terminal, a or b
-      p->elt = terminals[index];
-      p->left = nullptr;
-      p->right = nullptr;
-      return;
-    }
-    // if not in the leaf, then create an internal node, which is the operator, and then do the recursion
-    int op_index = randInt(rng, 0, ops.size() - 1);
-    string op = ops[op_index];
-    p->elt = op;
-    int opArity = arity(op);
-    if (opArity == 1)
-    {
-      p->left = new Node;
-      p->left->par = p;
-      randomExpressionTree(p->left, maxDepth - 1, rng, PARTIALLY_OBSERVABLE);
-      p->right = nullptr;
-    }
-    else if (opArity == 2)
+    for (size_t c; (c = next_chunk++) < chunks;)
     {
-      p->left = new Node;
-      p->right = new Node;
-      p->left->par = p;
-      p->right->par = p;
-      randomExpressionTree(p->left, maxDepth - 1, rng, PARTIALLY_OBSERVABLE);
-      randomExpressionTree(p->right, maxDepth - 1, rng, PARTIALLY_OBSERVABLE);
+      seed_seq seq{seed, unsigned(generation), unsigned(c)};
+      mt19937 rng(seq);
+      work(c * chunk_size, min(n, (c + 1) * chunk_size), rng);
     }
-    else if (opArity == 0)
+  };
+  int num_threads = max(1u, thread::hardware_concurrency());
+  vector<thread> threads;
+  for (int i = 1; i < num_threads; i++)
+    threads.push_back(thread(worker));
+  worker();
+  for (auto &t : threads)
+    t.join();
+}
+
+// random tree generator driven by a table of weighted choices: the ops drawn for
+// an inner node (an op of arity 0 such as read ends the branch there) and the
+// terminals drawn for a leaf, which may include ephemeral random constants. Nodes
+// are filled in place. Choices with equal weights are drawn with randInt, so the
+// standard table reproduces the GA's original generator draw for draw. Names are
+// copied into each node's elt, but they fit std::string's inline buffer, so the
+// copy allocates nothing; the time goes to allocating the nodes themselves.
+class TreeGenerator
+{
+public:
+  typedef LinkedBinaryTree::Node Node;
+  enum Method
+  {
+    GROW, // a leaf with the leaf probability at every node, or at the depth limit
+    FULL, // ops of arity 1 or 2 down to the depth limit, then leaves
+    RAMPED // ramped half-and-half: GROW and FULL over a range of depths
+  };
+
+  TreeGenerator() : leaf_probability(0.3) {}
+
+  // the GA's op set, with read and write when partially observable, and the
+  // terminals a and b, all equally likely
+  static TreeGenerator standard(bool partially_observable)
+  {
+    TreeGenerator g;
+    for (string op : {"+", "-", "*", "/", ">", "abs"})
+      g.addOp(op, 1.0);
+    if (partially_observable)
     {
-      p->left = nullptr;
-      p->right = nullptr;
+      g.addOp("read", 1.0);
+      g.addOp("write", 1.0);
     }
+    g.addTerminal("a", 1.0);
+    g.addTerminal("b", 1.0);
+    return g;
   }
-  else
+
+  void addOp(const string &op, double weight)
+  {
+    ops.add({op, arity(op), weight, 0, 0});
+    if (arity(op) >= 1)
+      branching.add(ops.choices.back());
+  }
+  void addTerminal(const string &terminal, double weight)
+  {
+    terminals.add({terminal, 0, weight, 0, 0});
+  }
+  // constants drawn uniformly from [lo, hi] for each leaf that picks this entry
+  void addConstant(double weight, double lo, double hi)
   {
-    static const vector<string> ops = {"+", "-", "*", "/", ">", "abs"};
+    if (weight > 0)
+      terminals.add({"", 0, weight, lo, hi});
+  }
+  void setLeafProbability(double p) { leaf_probability = p; }
 
-    // if get in the leaf from the recursion (base case), then create a leaf node
-    if (maxDepth == 0 || prob < 0.3) // when reaches the max depth or with 30% probability, generate the terminal node (leaf)
+  // fill the fresh node p with a random subtree of at most depth levels below it
+  void grow(Node *p, int depth, mt19937 &rng) const
+  {
+    double prob = randDouble(rng);
+    p->constant = false;
+    if (depth == 0 || prob < leaf_probability)
     {
-      int index = randInt(rng, 0, terminals.size() - 1); // randomly select a terminal, a or b
-      p->elt = terminals[index];
-      p->left = nullptr;
-      p->right = nullptr;
+      leaf(p, rng);
       return;
     }
-    // if not in the leaf, then create an internal node, which is the operator, and then do the recursion
-    int op_index = randInt(rng, 0, ops.size() - 1);
-    string op = ops[op_index];
-    p->elt = op;
-    int opArity = arity(op);
-    if (opArity == 1)
+    inner(p, ops.pick(rng), depth, rng, false);
+  }
+
+  void full(Node *p, int depth, mt19937 &rng) const
+  {
+    p->constant = false;
+    if (depth == 0 || branching.choices.empty() || terminals.choices.empty())
+      leaf(p, rng);
+    else
+      inner(p, branching.pick(rng), depth, rng, true);
+  }
+
+  // make n trees into trees, in parallel with an rng stream per chunk of 256
+  // trees. With RAMPED, tree i has depth limit min_depth + (i / 2) % (number of
+  // depths) and is grown when i is even, full when odd.
+  void fill(vector<LinkedBinaryTree> &trees, size_t n, Method method, int min_depth,
+            int max_depth, unsigned seed) const
+  {
+    trees.clear();
+    trees.resize(n);
+    int depths = max(1, max_depth - min_depth + 1);
+    forEachChunk(n, 256, seed, 0,
+                 [&](size_t begin, size_t end, mt19937 &rng)
+                 {
+                   for (size_t i = begin; i < end; i++)
+                   {
+                     trees[i].addRoot();
+                     bool use_full = method == FULL || (method == RAMPED && i % 2 == 1);
+                     int depth = method == RAMPED ? min_depth + (i / 2) % depths : max_depth;
+                     if (use_full)
+                       full(trees[i].root(), depth, rng);
+                     else
+                       grow(trees[i].root(), depth, rng);
+                   }
+                 });
+  }
+
+private:
+  struct Choice
+  {
+    string name;
+    int arity;
+    double weight;
+    double lo, hi; // range of a constant, whose name is empty
+  };
+  struct Table
+  {
+    vector<Choice> choices;
+    double total = 0;
+    bool uniform = true;
+
+    void add(const Choice &c)
     {
-      p->left = new Node;
-      p->left->par = p;
-      randomExpressionTree(p->left, maxDepth - 1, rng, PARTIALLY_OBSERVABLE);
-      p->right = nullptr;
+      uniform = uniform && (choices.empty() || c.weight == choices[0].weight);
+      choices.push_back(c);
+      total += c.weight;
     }
-    else if (opArity == 2)
+    const Choice &pick(mt19937 &rng) const
     {
-      p->left = new Node;
-      p->right = new Node;
-      p->left->par = p;
-      p->right->par = p;
-      randomExpressionTree(p->left, maxDepth - 1, rng, PARTIALLY_OBSERVABLE);
-      randomExpressionTree(p->right, maxDepth - 1, rng, PARTIALLY_OBSERVABLE);
+      if (uniform)
+        return choices[randInt(rng, 0, choices.size() - 1)];
+      double r = randDouble(rng) * total;
+      for (auto &c : choices)
+        if ((r -= c.weight) < 0)
+          return c;
+      return choices.back();
     }
-    else if (opArity == 0)
+  };
+
+  void leaf(Node *p, mt19937 &rng) const
+  {
+    const Choice &c = terminals.pick(rng);
+    if (c.name.empty())
     {
-      p->left = nullptr;
-      p->right = nullptr;
+      // the text is what the tree prints, the value is parsed from it so both agree
+      char text[32];
+      snprintf(text, sizeof(text), "%.6g", c.lo + (c.hi - c.lo) * randDouble(rng));
+      p->elt = text;
+      p->value = strtod(text, NULL);
+      p->constant = true;
     }
+    else
+      p->elt = c.name;
+    p->left = nullptr;
+    p->right = nullptr;
+  }
+
+  void inner(Node *p, const Choice &c, int depth, mt19937 &rng, bool use_full) const
+  {
+    p->elt = c.name;
+    p->left = c.arity >= 1 ? new Node : nullptr;
+    p->right = c.arity == 2 ? new Node : nullptr;
+    for (Node *child : {p->left, p->right})
+      if (child != nullptr)
+      {
+        if (use_full)
+          full(child, depth - 1, rng);
+        else
+          grow(child, depth - 1, rng);
+      }
   }
+
+  Table ops;
+  Table branching; // the ops of arity 1 or 2, for FULL
+  Table terminals;
+  double leaf_probability;
+};
+
+void LinkedBinaryTree::randomExpressionTree(Node *p, const int &maxDepth, mt19937 &rng, bool PARTIALLY_OBSERVABLE)
+{
+  static const TreeGenerator observable = TreeGenerator::standard(true);
+  static const TreeGenerator full_state = TreeGenerator::standard(false);
+  (PARTIALLY_OBSERVABLE ? observable : full_state).grow(p, maxDepth, rng);
 }
+
 LinkedBinaryTree createRandExpressionTree(int max_depth, mt19937 &rng, bool PARTIALLY_OBSERVABLE)
 {
   // modify this function to create and return a random expression tree
@@ -665,11 +888,220 @@ LinkedBinaryTree createRandExpressionTree(int max_depth, mt19937 &rng, bool PART
   return t;
 }
 
-// evaluate tree t in the cart centering task
-void evaluate(mt19937 &rng, LinkedBinaryTree &t, const int &num_episode,
-              bool animate, bool partially_observable = false)
+// compact binary form of a tree, see controllerProgram.h
+void encodeProgram(const LinkedBinaryTree::Node *v, string &out)
 {
-  cartCentering env;
+  Opcode op;
+  double value = 0;
+  if (v->left == NULL && v->right == NULL)
+  {
+    if (v->elt == "a")
+      op = OP_A;
+    else if (v->elt == "b")
+      op = OP_B;
+    else if (v->elt == "read" || v->elt == "write")
+      op = opcodeOf(v->elt);
+    else
+    {
+      op = OP_CONST;
+      value = v->constant ? v->value : stod(v->elt);
+    }
+  }
+  else
+    op = opcodeOf(v->elt);
+  out.push_back(char(op | (v->left != NULL ? HAS_LEFT : 0) | (v->right != NULL ? HAS_RIGHT : 0)));
+  if (op == OP_CONST)
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  if (v->left != NULL)
+    encodeProgram(v->left, out);
+  if (v->right != NULL)
+    encodeProgram(v->right, out);
+}
+
+string encodeProgram(const LinkedBinaryTree &t)
+{
+  string out;
+  if (t.root() != NULL)
+    encodeProgram(t.root(), out);
+  return out;
+}
+
+// rebuild the subtree starting at data[pos] into the fresh node v and return the
+// position after it
+size_t decodeProgram(const char *data, size_t pos, LinkedBinaryTree::Node *v)
+{
+  unsigned char byte = data[pos++];
+  Opcode op = Opcode(byte & OPCODE_MASK);
+  if (op == OP_CONST)
+  {
+    memcpy(&v->value, data + pos, sizeof(double));
+    pos += sizeof(double);
+    ostringstream ss;
+    ss << setprecision(17) << v->value;
+    v->elt = ss.str();
+    v->constant = true;
+  }
+  else
+    v->elt = opName(op);
+  if (byte & HAS_LEFT)
+  {
+    v->left = new LinkedBinaryTree::Node;
+    pos = decodeProgram(data, pos, v->left);
+  }
+  if (byte & HAS_RIGHT)
+  {
+    v->right = new LinkedBinaryTree::Node;
+    pos = decodeProgram(data, pos, v->right);
+  }
+  return pos;
+}
+
+LinkedBinaryTree decodeProgram(const string &program)
+{
+  LinkedBinaryTree t;
+  if (!program.empty())
+  {
+    t.addRoot();
+    decodeProgram(program.data(), 0, t.root());
+  }
+  return t;
+}
+
+// a tree flattened into instructions in evaluation order (children before their
+// parent, left before right). Identical subtrees with no side effects share one
+// instruction, which turns the tree into a DAG whose nodes are each computed once
+// per step. Results are the same as evaluateExpression.
+class CompiledTree
+{
+public:
+  typedef LinkedBinaryTree::Node Node;
+  typedef ProgramInstr Instr; // shared with ControllerProgram, see controllerProgram.h
+
+  CompiledTree() : root(-1) {}
+  CompiledTree(const LinkedBinaryTree &t, bool share = true) : root(-1)
+  {
+    if (t.root() == NULL)
+      return;
+    writes = hasWrite(t.root());
+    root = compile(t.root(), share).first;
+    regs.resize(code.size());
+  }
+
+  // evaluate the compiled tree, reading and writing the memory of t
+  double evaluate(LinkedBinaryTree &t, double a, double b)
+  {
+    for (size_t i = 0; i < code.size(); i++)
+      step(i, t, a, b);
+    return root >= 0 ? regs[root] : 0.0;
+  }
+
+  // execute instruction i alone; instructions must run in order
+  double step(int i, LinkedBinaryTree &t, double a, double b)
+  {
+    const Instr &in = code[i];
+    double x = in.left >= 0 ? regs[in.left] : 0.0;
+    double y = in.right >= 0 ? regs[in.right] : 0.0;
+    regs[i] = executeInstr(in, x, y, a, b, t.memoryCells());
+    return regs[i];
+  }
+
+  int size() const { return code.size(); }
+  int rootIndex() const { return root; }
+  const vector<Instr> &instructions() const { return code; }
+  const vector<double> &values() const { return regs; } // of the last evaluate()
+  void setValue(int i, double v) { regs[i] = v; }       // in place of running instruction i
+  const vector<const Node *> &sources() const { return nodes; } // first node of each instruction
+
+private:
+  bool hasWrite(const Node *v) const
+  {
+    if (v == NULL)
+      return false;
+    return v->elt == "write" || hasWrite(v->left) || hasWrite(v->right);
+  }
+
+  // append the instructions of the subtree at v and return the index of its value
+  // and whether it is pure, i.e. gives the same value wherever it occurs in a step
+  pair<int, bool> compile(const Node *v, bool share)
+  {
+    Instr in = {OP_UNKNOWN, -1, -1, 0.0};
+    bool pure = true;
+    if (v->left == NULL && v->right == NULL)
+    {
+      if (v->constant)
+      {
+        in.op = OP_CONST;
+        in.value = v->value;
+      }
+      else if (v->elt == "a")
+        in.op = OP_A;
+      else if (v->elt == "b")
+        in.op = OP_B;
+      else if (v->elt == "read" || v->elt == "write")
+        in.op = opcodeOf(v->elt);
+      else
+      {
+        in.op = OP_CONST;
+        in.value = stod(v->elt);
+      }
+    }
+    else
+    {
+      in.op = opcodeOf(v->elt);
+      pair<int, bool> x = compile(v->left, share);
+      in.left = x.first;
+      pure = x.second;
+      if (arity(v->elt) > 1)
+      {
+        pair<int, bool> y = compile(v->right, share);
+        in.right = y.first;
+        pure = pure && y.second;
+      }
+    }
+    // a read gives the same value throughout a step only if nothing writes
+    if (in.op == OP_WRITE || (in.op == OP_READ && writes))
+      pure = false;
+
+    if (pure && share)
+    {
+      ostringstream key;
+      key << in.op << ' ' << in.left << ' ' << in.right << ' ' << setprecision(17) << in.value;
+      auto it = shared.find(key.str());
+      if (it != shared.end())
+        return {it->second, true};
+      shared[key.str()] = code.size();
+    }
+    code.push_back(in);
+    nodes.push_back(v);
+    return {(int)code.size() - 1, pure};
+  }
+
+  vector<Instr> code;
+  vector<double> regs;
+  vector<const Node *> nodes;
+  unordered_map<string, int> shared;
+  bool writes = false;
+  int root;
+};
+
+// called by runEpisodes before each episode; policies that keep per-episode state
+// provide an overload
+template <typename Policy>
+void startEpisode(Policy &) {}
+
+// how the cart is simulated in every episode: the integrator, and how many TAU
+// steps each action is held for, i.e. one tree evaluation per CONTROL_STEPS * TAU
+// seconds
+const cartCentering::Integrator INTEGRATOR = cartCentering::EULER;
+const int CONTROL_STEPS = 1;
+
+// run num_episode episodes of the cart centering task, taking each action from
+// policy(a, b), and store the mean reward and steps in t
+template <typename Policy>
+void runEpisodes(mt19937 &rng, LinkedBinaryTree &t, Policy &&policy, const int &num_episode,
+                 bool animate, bool partially_observable)
+{
+  cartCentering env(INTEGRATOR, CONTROL_STEPS);
   double mean_score = 0.0;
   double mean_steps = 0.0;
   for (int i = 0; i < num_episode; i++)
@@ -681,20 +1113,21 @@ void evaluate(mt19937 &rng, LinkedBinaryTree &t, const int &num_episode,
     { // for part 4
       t.setMemory(0.0);
     }
+    startEpisode(policy);
     while (!env.terminal())
     {
       int action;
       if (partially_observable)
       {
-        action = t.evaluateExpression(env.getCartXPos(), 0.0);
+        action = policy(env.getCartXPos(), 0.0);
       }
       else
       {
-        action = t.evaluateExpression(env.getCartXPos(), env.getCartXVel());
+        action = policy(env.getCartXPos(), env.getCartXVel());
       }
       episode_score += env.update(action, animate);
-      episode_steps++;
     }
+    episode_steps = env.getStep(); // in TAU steps, whatever the control interval
     mean_score += episode_score;
     mean_steps += episode_steps;
   }
@@ -702,100 +1135,2650 @@ void evaluate(mt19937 &rng, LinkedBinaryTree &t, const int &num_episode,
   t.setSteps(mean_steps / num_episode);
 }
 
-class LexLessThan // use the class to achieve the operator
+// evaluate tree t in the cart centering task
+void evaluate(mt19937 &rng, LinkedBinaryTree &t, const int &num_episode,
+              bool animate, bool partially_observable = false)
 {
-public:
-  bool operator()(const LinkedBinaryTree &A, const LinkedBinaryTree &B) const
-  {
-    if (fabs(A.getScore() - B.getScore()) < 0.01)
+  runEpisodes(
+      rng, t, [&t](double a, double b)
+      { return t.evaluateExpression(a, b); },
+      num_episode, animate, partially_observable);
+}
+
+// counters reported at the end of a run that uses evaluateAnalyzed or evaluateCompiled
+struct EvalStats
+{
+  long trees = 0;
+  long nodes = 0;          // nodes of the analysed trees
+  long constant = 0;       // trees whose action never changes
+  long folded_nodes = 0;   // nodes removed by constant folding
+  long compiled_nodes = 0; // nodes of the compiled trees
+  long instructions = 0;   // instructions left after sharing common subexpressions
+};
+
+// evaluate tree t like evaluate() does, but compute each repeated pure subtree
+// only once per step
+void evaluateCompiled(mt19937 &rng, LinkedBinaryTree &t, const int &num_episode,
+                      bool animate, bool partially_observable, EvalStats &stats)
+{
+  CompiledTree c(t);
+  stats.compiled_nodes += t.size();
+  stats.instructions += c.size();
+  runEpisodes(
+      rng, t, [&](double a, double b)
+      { return c.evaluate(t, a, b); },
+      num_episode, animate, partially_observable);
+}
+
+// closed range [lo, hi] of the values an expression can take
+struct Interval
+{
+  double lo;
+  double hi;
+  bool isPoint() const { return lo == hi; }
+  bool operator==(const Interval &o) const { return lo == o.lo && hi == o.hi; }
+  bool operator!=(const Interval &o) const { return !(*this == o); }
+};
+
+const Interval ANY_VALUE = {-INFINITY, INFINITY};
+
+Interval hull(const Interval &x, const Interval &y)
+{
+  return {std::min(x.lo, y.lo), std::max(x.hi, y.hi)};
+}
+
+// widen a computed range so that it also holds the rounding errors of the real
+// computation and the 0 that evalOp returns in place of inf or nan
+Interval sanitizeRange(double lo, double hi)
+{
+  if (isnan(lo) || isnan(hi))
+    return ANY_VALUE;
+  lo = nextafter(lo, -INFINITY);
+  hi = nextafter(hi, INFINITY);
+  if (!isfinite(lo) || !isfinite(hi))
+  {
+    lo = std::min(lo, 0.0);
+    hi = std::max(hi, 0.0);
+  }
+  return {lo, hi};
+}
+
+// return the range of a read when every memory cell holds the same value in
+// memory. Read sums the cells, and a sum that overflows to inf gives 0.
+Interval readRange(const Interval &memory)
+{
+  if (memory.isPoint())
+  {
+    // same computation as at run time, so the result is exact
+    double cells[MEMORY_CELLS];
+    for (double &c : cells)
+      c = memory.lo;
+    double m = applyOp(OP_READ, 0.0, 0.0, cells);
+    return {m, m};
+  }
+  Interval r = sanitizeRange(memory.lo, memory.hi);
+  if (std::max(fabs(memory.lo), fabs(memory.hi)) > DBL_MAX / MEMORY_CELLS)
+  {
+    r.lo = std::min(r.lo, 0.0);
+    r.hi = std::max(r.hi, 0.0);
+  }
+  return r;
+}
+
+// return the range of evalOp(op, x, y) over all x in X and y in Y. read and
+// write are handled by the caller since they depend on the memory.
+Interval intervalOp(const string &op, const Interval &X, const Interval &Y)
+{
+  if (X.isPoint() && Y.isPoint())
+  {
+    // same computation as at run time, so the result is exact
+    static LinkedBinaryTree scratch;
+    double r = evalOp(op, scratch, X.lo, Y.lo);
+    return {r, r};
+  }
+  if (op == "+")
+    return sanitizeRange(X.lo + Y.lo, X.hi + Y.hi);
+  else if (op == "-")
+    return sanitizeRange(X.lo - Y.hi, X.hi - Y.lo);
+  else if (op == "*")
+  {
+    double c[4] = {X.lo * Y.lo, X.lo * Y.hi, X.hi * Y.lo, X.hi * Y.hi};
+    for (double v : c)
+      if (isnan(v))
+        return ANY_VALUE;
+    return sanitizeRange(*std::min_element(c, c + 4), *std::max_element(c, c + 4));
+  }
+  else if (op == "/")
+  {
+    if (Y.lo <= 0 && Y.hi >= 0)
+    {
+      // 0 / y is 0, and x / 0 is inf or nan which evalOp turns into 0
+      if (X.lo == 0 && X.hi == 0)
+        return {0, 0};
+      return ANY_VALUE;
+    }
+    double c[4] = {X.lo / Y.lo, X.lo / Y.hi, X.hi / Y.lo, X.hi / Y.hi};
+    for (double v : c)
+      if (isnan(v))
+        return ANY_VALUE;
+    return sanitizeRange(*std::min_element(c, c + 4), *std::max_element(c, c + 4));
+  }
+  else if (op == ">")
+  {
+    if (X.lo > Y.hi)
+      return {1, 1};
+    if (X.hi <= Y.lo)
+      return {-1, -1};
+    return {-1, 1};
+  }
+  else if (op == "abs")
+  {
+    if (X.lo >= 0)
+      return X;
+    if (X.hi <= 0)
+      return {-X.hi, -X.lo};
+    return {0, std::max(-X.lo, X.hi)};
+  }
+  return {0, 0};
+}
+
+// interval analysis of a tree over every state the cart can be evaluated in
+// (|x| <= MAX_X, |v| <= MAX_V). It finds subtrees whose value never changes and
+// trees whose action never changes, so that they need not be interpreted each step.
+class IntervalAnalysis
+{
+public:
+  typedef LinkedBinaryTree::Node Node;
+
+  IntervalAnalysis(const LinkedBinaryTree &t, bool partially_observable)
+      : tree(t), folded_nodes(0)
+  {
+    cartCentering env;
+    a_range = {-env.getMaxX(), env.getMaxX()};
+    b_range = partially_observable ? Interval{0, 0} : Interval{-env.getMaxV(), env.getMaxV()};
+    if (t.root() == NULL)
+    {
+      root_range = {0, 0};
+      return;
+    }
+    // memory starts at 0 each episode when partially observable, otherwise it is
+    // whatever the tree was left with. Widen it with every value that can be
+    // written until it stops changing.
+    memory_range = partially_observable ? Interval{0, 0} : ANY_VALUE;
+    for (int i = 0;; i++)
+    {
+      Interval written = memory_range;
+      ranges.clear();
+      root_range = analyse(t.root(), written);
+      if (written == memory_range)
+        break;
+      memory_range = i < 8 ? hull(memory_range, written) : ANY_VALUE;
+    }
+  }
+
+  Interval rootRange() const { return root_range; }
+
+  // return -1 or 1 if the action of the tree is the same in every state, else 0
+  int constantAction() const
+  {
+    // evaluate() truncates the output to an int and only looks at its sign
+    if (root_range.hi <= -1 && root_range.lo >= INT32_MIN)
+      return -1;
+    if (root_range.lo > -1 && root_range.hi <= INT32_MAX)
+      return 1;
+    return 0;
+  }
+
+  // return a copy of the tree where every subtree with a constant value and no
+  // write is replaced by a leaf holding that value
+  LinkedBinaryTree folded()
+  {
+    LinkedBinaryTree f;
+    f.setGeneration(tree.getGeneration());
+    if (tree.root() == NULL)
+      return f;
+    f.addRoot();
+    fold(tree.root(), f.root());
+    return f;
+  }
+  int getFoldedNodes() const { return folded_nodes; }
+
+private:
+  // return the range of the subtree at v and add every value written to memory
+  // inside it to written
+  Interval analyse(const Node *v, Interval &written)
+  {
+    Interval r;
+    if (v->left == NULL && v->right == NULL)
+    {
+      if (v->elt == "a")
+        r = a_range;
+      else if (v->elt == "b")
+        r = b_range;
+      else if (v->elt == "read")
+        r = readRange(memory_range);
+      else if (v->elt == "write")
+      {
+        r = {0, 0};
+        written = hull(written, r);
+      }
+      else
+      {
+        double c = v->constant ? v->value : stod(v->elt);
+        r = {c, c};
+      }
+    }
+    else
+    {
+      Interval x = analyse(v->left, written);
+      Interval y = {0, 0};
+      if (arity(v->elt) > 1)
+        y = analyse(v->right, written);
+      if (v->elt == "read")
+        r = readRange(memory_range);
+      else if (v->elt == "write")
+      {
+        r = x;
+        written = hull(written, x);
+      }
+      else
+        r = intervalOp(v->elt, x, y);
+    }
+    ranges[v] = r;
+    return r;
+  }
+
+  bool hasWrite(const Node *v) const
+  {
+    if (v == NULL)
+      return false;
+    return v->elt == "write" || hasWrite(v->left) || hasWrite(v->right);
+  }
+
+  // copy the subtree at v into the fresh node n, folding constant subtrees
+  void fold(const Node *v, Node *n)
+  {
+    Interval r = ranges[v];
+    if (r.isPoint() && (v->left != NULL || v->right != NULL) && !hasWrite(v))
+    {
+      ostringstream ss;
+      ss << setprecision(17) << r.lo; // enough digits for stod to give r.lo back
+      n->elt = ss.str();
+      n->constant = true;
+      n->value = r.lo;
+      folded_nodes += LinkedBinaryTree().size(const_cast<Node *>(v)) - 1;
+      return;
+    }
+    n->elt = v->elt;
+    if (v->left != NULL)
+    {
+      n->left = new Node;
+      fold(v->left, n->left);
+    }
+    if (v->right != NULL)
+    {
+      n->right = new Node;
+      fold(v->right, n->right);
+    }
+  }
+
+  const LinkedBinaryTree &tree;
+  Interval a_range;
+  Interval b_range;
+  Interval memory_range;
+  Interval root_range;
+  unordered_map<const Node *, Interval> ranges;
+  int folded_nodes;
+};
+
+// evaluate tree t like evaluate() does, but skip interpreting the tree when its
+// action is provably constant and otherwise interpret a constant-folded copy
+void evaluateAnalyzed(mt19937 &rng, LinkedBinaryTree &t, const int &num_episode,
+                      bool animate, bool partially_observable, EvalStats &stats,
+                      bool use_cse = false)
+{
+  IntervalAnalysis analysis(t, partially_observable);
+  stats.trees++;
+  stats.nodes += t.size();
+  int action = analysis.constantAction();
+  if (action != 0)
+  {
+    stats.constant++;
+    runEpisodes(
+        rng, t, [action](double, double)
+        { return action; },
+        num_episode, animate, partially_observable);
+    return;
+  }
+  LinkedBinaryTree f = analysis.folded();
+  stats.folded_nodes += analysis.getFoldedNodes();
+  if (use_cse)
+    evaluateCompiled(rng, f, num_episode, animate, partially_observable, stats);
+  else
+    evaluate(rng, f, num_episode, animate, partially_observable);
+  t.setScore(f.getScore());
+  t.setSteps(f.getSteps());
+}
+
+// policy for runEpisodes that runs a compiled tree and records, for every node,
+// how often it ran, how often its value changed from one step to the next and
+// how often that change alone flipped the action. A flip is found by recomputing
+// the path to the root with the node's previous value; memory is taken as fixed
+// during that recomputation. A node is live if in some step one of a few probe
+// values in its place would have flipped the action, or if its value is written
+// to memory that the tree reads.
+class TreeProfile
+{
+public:
+  typedef LinkedBinaryTree::Node Node;
+  struct NodeStats
+  {
+    long executions = 0;
+    long changes = 0;
+    long flips = 0;
+  };
+
+  TreeProfile(LinkedBinaryTree &t)
+      : tree(t), code(t, false), have_previous(false), reads_memory(false)
+  {
+    const vector<CompiledTree::Instr> &in = code.instructions();
+    stats.resize(in.size());
+    previous.resize(in.size());
+    live.assign(in.size(), false);
+    parent.assign(in.size(), -1);
+    subtree_size.assign(in.size(), 1);
+    for (int i = 0; i < (int)in.size(); i++)
+    {
+      // nothing is shared, so every instruction has a single parent
+      if (in[i].left >= 0)
+      {
+        parent[in[i].left] = i;
+        subtree_size[i] += subtree_size[in[i].left];
+      }
+      if (in[i].right >= 0)
+      {
+        parent[in[i].right] = i;
+        subtree_size[i] += subtree_size[in[i].right];
+      }
+      reads_memory = reads_memory || in[i].op == OP_READ;
+    }
+    feeds_write.assign(in.size(), false);
+    for (int i = (int)in.size() - 1; i >= 0; i--) // parents come after their children
+      if (parent[i] >= 0)
+        feeds_write[i] = in[parent[i]].op == OP_WRITE || feeds_write[parent[i]];
+  }
+
+  void startEpisode() { have_previous = false; }
+
+  double operator()(double a, double b)
+  {
+    if (code.size() == 0)
+      return 0.0;
+    double result = code.evaluate(tree, a, b);
+    const vector<double> &values = code.values();
+    int action = result;
+    for (int i = 0; i < code.size(); i++)
+    {
+      stats[i].executions++;
+      if (!live[i])
+        live[i] = (reads_memory && feeds_write[i]) || canFlip(i, action);
+      if (!have_previous || values[i] == previous[i])
+        continue;
+      stats[i].changes++;
+      int other = rootValueWith(i, previous[i]);
+      if ((other < 0) != (action < 0))
+        stats[i].flips++;
+    }
+    previous = values;
+    have_previous = true;
+    return result;
+  }
+
+  int size() const { return code.size(); }
+  const NodeStats &nodeStats(int i) const { return stats[i]; }
+  Opcode op(int i) const { return code.instructions()[i].op; }
+  const Node *node(int i) const { return code.sources()[i]; }
+  int parentOf(int i) const { return parent[i]; }
+  int subtreeSize(int i) const { return subtree_size[i]; }
+  const LinkedBinaryTree &getTree() const { return tree; }
+
+  // a node is dead if neither it nor any node in its subtree was ever live
+  vector<bool> deadNodes() const
+  {
+    vector<bool> dead(code.size(), true);
+    for (int i = 0; i < code.size(); i++) // children come before their parent
+    {
+      const CompiledTree::Instr &in = code.instructions()[i];
+      dead[i] = !live[i] && (in.left < 0 || dead[in.left]) &&
+                (in.right < 0 || dead[in.right]);
+    }
+    return dead;
+  }
+
+private:
+  // return true if some probe value in place of node i changes the action
+  bool canFlip(int i, int action)
+  {
+    double v = code.values()[i];
+    for (double probe : {0.0, -v, 1e6, -1e6})
+      if (probe != v && (rootValueWith(i, probe) < 0) != (action < 0))
+        return true;
+    return false;
+  }
+
+  // return the action the tree would have taken with node i set to value
+  int rootValueWith(int i, double value)
+  {
+    static LinkedBinaryTree scratch; // pure operations do not touch it
+    const vector<CompiledTree::Instr> &in = code.instructions();
+    const vector<double> &values = code.values();
+    while (parent[i] >= 0)
+    {
+      int p = parent[i];
+      double x = in[p].left == i ? value : (in[p].left >= 0 ? values[in[p].left] : 0.0);
+      double y = in[p].right == i ? value : (in[p].right >= 0 ? values[in[p].right] : 0.0);
+      if (in[p].op == OP_READ)
+        return values[code.rootIndex()]; // the value read does not depend on the child
+      else if (in[p].op == OP_WRITE)
+        value = x;
+      else
+        value = evalOp(in[p].op, scratch, x, y);
+      i = p;
+    }
+    int action = value;
+    return action;
+  }
+
+  LinkedBinaryTree &tree;
+  CompiledTree code;
+  bool have_previous;
+  bool reads_memory;
+  vector<NodeStats> stats;
+  vector<double> previous;
+  vector<bool> live;
+  vector<bool> feeds_write; // the node's value reaches a write
+  vector<int> parent;
+  vector<int> subtree_size;
+};
+
+void startEpisode(TreeProfile &p) { p.startEpisode(); }
+
+// collects the profiles of the trees evaluated in a generation and writes a
+// report of per-opcode counts and time, dead code and the most decisive nodes
+class ControllerProfiler
+{
+public:
+  ControllerProfiler(const string &path) : out(path), op_ns(measureOpCosts()), generation(0)
+  {
+    out << "ns per instruction, timed over a batched loop of each op:";
+    for (int op = 0; op < OP_UNKNOWN; op++)
+      out << " " << opName(Opcode(op)) << " " << fixed << setprecision(2) << op_ns[op];
+    out << defaultfloat << setprecision(6) << endl
+        << endl;
+  }
+
+  void beginGeneration(int g)
+  {
+    generation = g;
+    trees = 0;
+    nodes = 0;
+    dead = 0;
+    ops.assign(OP_UNKNOWN + 1, TreeProfile::NodeStats());
+    dead_subtrees.clear();
+    decisive.clear();
+  }
+
+  void add(const TreeProfile &p)
+  {
+    trees++;
+    nodes += p.size();
+    vector<bool> is_dead = p.deadNodes();
+    for (int i = 0; i < p.size(); i++)
+    {
+      const TreeProfile::NodeStats &s = p.nodeStats(i);
+      TreeProfile::NodeStats &o = ops[p.op(i)];
+      o.executions += s.executions;
+      o.changes += s.changes;
+      o.flips += s.flips;
+      if (is_dead[i])
+      {
+        dead++;
+        // only report the largest dead subtrees, not the dead nodes inside them
+        int par = p.parentOf(i);
+        if (p.subtreeSize(i) > 1 && (par < 0 || !is_dead[par]))
+          dead_subtrees.push_back({(double)p.subtreeSize(i) * s.executions, describe(p, i)});
+      }
+      else if (s.flips > 0)
+        decisive.push_back({(double)s.flips / std::max(1L, s.executions), describe(p, i)});
+    }
+  }
+
+  // append the report for the current generation
+  void report()
+  {
+    long executions = 0;
+    double ns = 0;
+    for (int op = 0; op < (int)ops.size(); op++)
+    {
+      executions += ops[op].executions;
+      ns += ops[op].executions * op_ns[op];
+    }
+    out << "generation " << generation << ": " << trees << " trees, " << nodes
+        << " nodes, " << executions << " node executions, about " << fixed << setprecision(3)
+        << ns / 1e6 << " ms in nodes" << endl;
+    out << "  op      executions    share     ms  changed  flipped" << endl;
+    for (int op = 0; op < (int)ops.size(); op++)
+    {
+      const TreeProfile::NodeStats &o = ops[op];
+      if (o.executions == 0)
+        continue;
+      out << "  " << left << setw(6) << opName(Opcode(op)) << right << setw(12) << o.executions
+          << setw(8) << setprecision(1) << 100.0 * o.executions / executions << "%"
+          << setw(7) << setprecision(3) << o.executions * op_ns[op] / 1e6
+          << setw(8) << setprecision(1) << 100.0 * o.changes / o.executions << "%"
+          << setw(8) << setprecision(2) << 100.0 * o.flips / o.executions << "%" << endl;
+    }
+    out << "  dead nodes (could never change the action): " << dead << " of " << nodes << endl;
+    writeTop("  largest dead subtrees (nodes x executions):", dead_subtrees);
+    writeTop("  most decisive nodes (share of steps flipped):", decisive);
+    out << defaultfloat << setprecision(6) << endl;
+  }
+
+  // append an annotated listing of a single tree
+  void reportTree(const string &title, const TreeProfile &p)
+  {
+    vector<bool> is_dead = p.deadNodes();
+    out << title << endl;
+    out << "  executions  changes    flips        ms  subtree" << endl;
+    for (int i = p.size() - 1; i >= 0; i--) // root first
+    {
+      const TreeProfile::NodeStats &s = p.nodeStats(i);
+      out << setw(12) << s.executions << setw(9) << s.changes << setw(9) << s.flips
+          << setw(10) << fixed << setprecision(3) << s.executions * op_ns[p.op(i)] / 1e6
+          << (is_dead[i] ? "  dead  " : "        ") << describe(p, i) << endl;
+    }
+    out << defaultfloat << setprecision(6) << endl;
+  }
+
+private:
+  // ns to execute one instruction of each opcode. Timing single instructions
+  // would measure mostly the clock, so each op runs over a batch of inputs and
+  // the whole loop is timed.
+  static vector<double> measureOpCosts()
+  {
+    const int batch = 1024, rounds = 1000;
+    mt19937 gen(1);
+    uniform_real_distribution<double> dist(-2.0, 2.0);
+    vector<double> x(batch), y(batch);
+    for (int k = 0; k < batch; k++)
+    {
+      x[k] = dist(gen);
+      y[k] = dist(gen);
+    }
+    double memory[MEMORY_CELLS] = {0, 0, 0, 0};
+    vector<double> cost(OP_UNKNOWN + 1, 0.0);
+    volatile double sink = 0;
+    for (int op = 0; op < OP_UNKNOWN; op++)
+    {
+      // one instruction per input, so the op is dispatched each time as in a tree
+      vector<ProgramInstr> code(batch, ProgramInstr{Opcode(op), 0, 1, 0.5});
+      double sum = 0;
+      auto start = chrono::steady_clock::now();
+      for (int r = 0; r < rounds; r++)
+        for (int k = 0; k < batch; k++)
+          sum += executeInstr(code[k], x[k], y[k], x[k], y[k], memory);
+      auto end = chrono::steady_clock::now();
+      sink = sink + sum;
+      cost[op] = chrono::duration<double, nano>(end - start).count() / ((double)rounds * batch);
+    }
+    return cost;
+  }
+
+  string describe(const TreeProfile &p, int i) const
+  {
+    ostringstream ss;
+    p.getTree().printExpression(p.node(i), ss);
+    return ss.str();
+  }
+
+  void writeTop(const string &title, vector<pair<double, string>> &items, size_t n = 5)
+  {
+    out << title << endl;
+    n = std::min(n, items.size());
+    partial_sort(items.begin(), items.begin() + n, items.end(),
+                 [](const pair<double, string> &x, const pair<double, string> &y)
+                 { return x.first > y.first; });
+    for (size_t i = 0; i < n; i++)
+      out << "    " << setprecision(3) << items[i].first << "  " << items[i].second << endl;
+  }
+
+  ofstream out;
+  vector<double> op_ns; // from measureOpCosts
+  int generation;
+  long trees;
+  long nodes;
+  long dead;
+  vector<TreeProfile::NodeStats> ops;
+  vector<pair<double, string>> dead_subtrees;
+  vector<pair<double, string>> decisive;
+};
+
+// evaluate tree t like evaluate() does while recording its profile
+void evaluateProfiled(mt19937 &rng, LinkedBinaryTree &t, const int &num_episode,
+                      bool animate, bool partially_observable, ControllerProfiler &profiler)
+{
+  TreeProfile p(t);
+  runEpisodes(rng, t, p, num_episode, animate, partially_observable);
+  profiler.add(p);
+}
+
+// one tree in a genealogy log
+struct GenealogyRecord
+{
+  int64_t id;
+  int64_t parent1; // -1 if none
+  int64_t parent2; // -1 if none
+  int32_t generation;
+  uint8_t origin;
+  double fitness; // nan if the tree was never evaluated
+  double steps;
+  string program; // encodeProgram() of the tree
+};
+
+const char GENEALOGY_MAGIC[8] = {'G', 'P', 'G', 'E', 'N', 'E', '0', '1'};
+
+// append-only binary log of every tree born in a run. Records are packed into a
+// buffer by the GA thread and written to the file by a background thread, so the
+// GA only pays for encoding the tree.
+class GenealogyLog
+{
+public:
+  GenealogyLog(const string &path, size_t buffer_size = 1 << 20)
+      : file(fopen(path.c_str(), "wb")), buffer_size(buffer_size), done(false), records(0)
+  {
+    if (file == NULL)
+    {
+      cerr << "cannot open " << path << endl;
+      exit(1);
+    }
+    fwrite(GENEALOGY_MAGIC, 1, sizeof(GENEALOGY_MAGIC), file);
+    writer = thread(&GenealogyLog::writeLoop, this);
+  }
+
+  ~GenealogyLog()
+  {
+    flush();
+    {
+      lock_guard<mutex> lock(m);
+      done = true;
+    }
+    ready.notify_one();
+    writer.join();
+    fclose(file);
+  }
+
+  // append tree t; evaluated is false for trees whose score is not their own, and
+  // born overrides the generation stored in t
+  void record(const LinkedBinaryTree &t, bool evaluated = true, long born = -1)
+  {
+    int64_t id = t.getId(), p1 = t.getParent1(), p2 = t.getParent2();
+    int32_t generation = born >= 0 ? born : t.getGeneration();
+    uint8_t origin = t.getOrigin();
+    double fitness = evaluated ? t.getScore() : NAN;
+    double steps = evaluated ? t.getSteps() : NAN;
+    string program = encodeProgram(t);
+    uint32_t length = program.size();
+    put(id);
+    put(p1);
+    put(p2);
+    put(generation);
+    put(origin);
+    put(fitness);
+    put(steps);
+    put(length);
+    current.append(program);
+    records++;
+    if (current.size() >= buffer_size)
+      flush();
+  }
+
+  long getRecords() const { return records; }
+
+  // hand the current buffer to the writer thread
+  void flush()
+  {
+    if (current.empty())
+      return;
+    unique_lock<mutex> lock(m);
+    // bound the memory held by a writer that falls behind
+    space.wait(lock, [this]
+               { return pending.size() < 4; });
+    pending.push_back(std::move(current));
+    current.clear();
+    current.reserve(buffer_size + 256);
+    lock.unlock();
+    ready.notify_one();
+  }
+
+private:
+  template <typename T>
+  void put(const T &x)
+  {
+    current.append(reinterpret_cast<const char *>(&x), sizeof(x));
+  }
+
+  void writeLoop()
+  {
+    unique_lock<mutex> lock(m);
+    while (true)
+    {
+      ready.wait(lock, [this]
+                 { return done || !pending.empty(); });
+      if (pending.empty())
+        return;
+      string buffer = std::move(pending.front());
+      pending.pop_front();
+      space.notify_one();
+      lock.unlock();
+      fwrite(buffer.data(), 1, buffer.size(), file);
+      lock.lock();
+    }
+  }
+
+  FILE *file;
+  size_t buffer_size;
+  string current;
+  deque<string> pending;
+  mutex m;
+  condition_variable ready; // pending has a buffer or done is set
+  condition_variable space; // pending has room for another buffer
+  bool done;
+  long records;
+  thread writer;
+};
+
+// read the next record of a genealogy log, return false at the end of the file
+bool readGenealogyRecord(istream &in, GenealogyRecord &r)
+{
+  uint32_t length;
+  in.read(reinterpret_cast<char *>(&r.id), sizeof(r.id));
+  in.read(reinterpret_cast<char *>(&r.parent1), sizeof(r.parent1));
+  in.read(reinterpret_cast<char *>(&r.parent2), sizeof(r.parent2));
+  in.read(reinterpret_cast<char *>(&r.generation), sizeof(r.generation));
+  in.read(reinterpret_cast<char *>(&r.origin), sizeof(r.origin));
+  in.read(reinterpret_cast<char *>(&r.fitness), sizeof(r.fitness));
+  in.read(reinterpret_cast<char *>(&r.steps), sizeof(r.steps));
+  in.read(reinterpret_cast<char *>(&length), sizeof(length));
+  if (!in)
+    return false;
+  r.program.resize(length);
+  in.read(&r.program[0], length);
+  return bool(in);
+}
+
+// return the records of tree id and its ancestors through their first parent,
+// newest first, from the genealogy log at path
+vector<GenealogyRecord> traceLineage(const string &path, long id)
+{
+  ifstream in(path, ios::binary);
+  char magic[sizeof(GENEALOGY_MAGIC)];
+  in.read(magic, sizeof(magic));
+  if (!in || memcmp(magic, GENEALOGY_MAGIC, sizeof(magic)) != 0)
+    return {};
+  unordered_map<int64_t, GenealogyRecord> byId;
+  GenealogyRecord r;
+  while (readGenealogyRecord(in, r))
+  {
+    r.program.clear(); // only the lineage is needed
+    byId[r.id] = r;
+  }
+  vector<GenealogyRecord> lineage;
+  auto it = byId.find(id);
+  while (it != byId.end())
+  {
+    lineage.push_back(it->second);
+    it = byId.find(it->second.parent1);
+  }
+  return lineage;
+}
+
+// cache of fitness values keyed by a behavioral fingerprint: the action sign of a
+// tree on a fixed set of probe states. Offspring that compute the same action as
+// an already evaluated tree reuse its score instead of running the episodes again.
+// For trees without memory a match is approximate: two trees that agree on every
+// probe may still differ between them. The probes only see one history of a tree
+// with memory, so such a tree is only matched with a tree with memory whose
+// actions it reproduces over all of that tree's evaluation episodes, which gives
+// exactly the same score. Fingerprints are forgotten oldest first once there are
+// more than max_entries entries or max_actions recorded actions.
+class FitnessCache
+{
+public:
+  FitnessCache(bool partially_observable, int num_probes = 128, size_t max_entries = 1 << 16,
+               size_t max_actions = 1 << 26, size_t max_bucket = 8)
+      : partially_observable(partially_observable), max_entries(max_entries),
+        max_actions(max_actions), max_bucket(max_bucket), entries(0), actions(0),
+        lookups(0), hits(0), verified(0), rejected(0)
+  {
+    // probes are drawn once from a fixed seed so that fingerprints are comparable
+    // across generations and do not consume the experiment's rng
+    cartCentering env;
+    mt19937 probe_rng(12345);
+    double x_ini = env.getMaxVarIni();
+    double near = 10 * env.getNearOrigin();
+    for (int i = 0; i < num_probes; i++)
+    {
+      double x_range, v_range;
+      if (i % 4 == 0) // anywhere the cart can be
+      {
+        x_range = env.getMaxX();
+        v_range = env.getMaxV();
+      }
+      else if (i % 4 == 1) // close to the goal, where most decisions matter
+      {
+        x_range = near;
+        v_range = near;
+      }
+      else // the region episodes start from
+      {
+        x_range = x_ini;
+        v_range = x_ini;
+      }
+      probes.push_back({std::uniform_real_distribution<>{-x_range, x_range}(probe_rng),
+                        std::uniform_real_distribution<>{-v_range, v_range}(probe_rng)});
+    }
+    // start states of episodeTrace
+    for (int i = 0; i < 4; i++)
+    {
+      env.reset(probe_rng);
+      starts.push_back({env.getCartXPos(), env.getCartXVel()});
+    }
+  }
+
+  // return the action signs of t on the probe states, packed 8 per byte
+  string fingerprint(const LinkedBinaryTree &t) const
+  {
+    LinkedBinaryTree probe(t); // keep t's memory untouched
+    probe.setMemory(0.0);      // trees with memory are probed as one sequence
+    string fp((probes.size() + 7) / 8, '\0');
+    for (size_t i = 0; i < probes.size(); i++)
+    {
+      int action = probe.evaluateExpression(probes[i].first,
+                                            partially_observable ? 0.0 : probes[i].second);
+      if (action < 0)
+        fp[i / 8] |= char(1 << (i % 8));
+    }
+    return fp;
+  }
+
+  // if a tree with fingerprint fp and the same behaviour has been evaluated, copy
+  // its score and steps to t (not yet evaluated) and return true
+  bool lookup(const string &fp, LinkedBinaryTree &t)
+  {
+    lookups++;
+    auto it = cache.find(fp);
+    if (it == cache.end())
+      return false;
+    bool memory = t.usesMemory();
+    for (auto &e : it->second)
+    {
+      if (e.memory != memory)
+        continue;
+      if (memory)
+      {
+        // replay t on e's evaluation episodes; the same actions give the same
+        // states, rewards and episode lengths
+        if (e.actions.empty())
+        {
+          followActions(e.tree, e.starts, NULL, &e.actions);
+          actions += e.actions.size();
+        }
+        if (!followActions(t, e.starts, &e.actions, NULL))
+        {
+          rejected++;
+          continue;
+        }
+        verified++;
+      }
+      t.setScore(e.score);
+      t.setSteps(e.steps);
+      hits++;
+      return true;
+    }
+    return false;
+  }
+
+  // remember the score of tree t, evaluated by runEpisodes with num_episode
+  // episodes drawn from rng_before; unevaluated is t as it was before, whose
+  // memory the episodes started from
+  void insert(const string &fp, const LinkedBinaryTree &unevaluated, const LinkedBinaryTree &t,
+              mt19937 rng_before, int num_episode)
+  {
+    auto it = cache.find(fp);
+    if (it == cache.end())
+    {
+      it = cache.emplace(fp, vector<Entry>()).first;
+      order.push_back(fp);
+    }
+    vector<Entry> &bucket = it->second;
+    bool memory = t.usesMemory();
+    int same_kind = 0;
+    for (auto &e : bucket)
+      same_kind += e.memory == memory;
+    // one entry stands for all memory-free trees of a fingerprint
+    if (memory ? same_kind >= (int)max_bucket : same_kind > 0)
+      return;
+    Entry e;
+    e.memory = memory;
+    e.score = t.getScore();
+    e.steps = t.getSteps();
+    if (memory)
+    {
+      // runEpisodes only draws from rng to reset each episode
+      e.tree = unevaluated;
+      cartCentering env;
+      for (int i = 0; i < num_episode; i++)
+      {
+        env.reset(rng_before);
+        e.starts.push_back({env.getCartXPos(), env.getCartXVel()});
+      }
+    }
+    bucket.push_back(e);
+    entries++;
+    while (!order.empty() && (entries > max_entries || actions > max_actions))
+    {
+      auto oldest = cache.find(order.front());
+      entries -= oldest->second.size();
+      for (auto &old : oldest->second)
+        actions -= old.actions.size();
+      cache.erase(oldest);
+      order.pop_front();
+    }
+  }
+
+  // return the actions of t over whole episodes from the fixed start states; two
+  // trees with equal traces behave the same in those episodes whatever their memory
+  string episodeTrace(const LinkedBinaryTree &t) const
+  {
+    LinkedBinaryTree probe(t);
+    cartCentering env(INTEGRATOR, CONTROL_STEPS);
+    string trace;
+    for (auto &s : starts)
+    {
+      env.reset(s.first, s.second);
+      probe.setMemory(0.0);
+      while (!env.terminal())
+      {
+        int action = probe.evaluateExpression(env.getCartXPos(),
+                                              partially_observable ? 0.0 : env.getCartXVel());
+        trace.push_back(action < 0 ? '<' : '>');
+        env.update(action);
+      }
+      trace.push_back('|');
+    }
+    return trace;
+  }
+
+  long getLookups() const { return lookups; }
+  long getHits() const { return hits; }
+  long getVerified() const { return verified; }
+  long getRejected() const { return rejected; }
+
+private:
+  struct Entry
+  {
+    bool memory;
+    double score;
+    double steps;
+    // for a tree with memory: the tree before evaluation, the start states of its
+    // evaluation episodes and its actions in them, recorded on first use
+    LinkedBinaryTree tree;
+    vector<pair<double, double>> starts;
+    string actions;
+  };
+
+  // run t from each of starts as runEpisodes does, recording its actions to record
+  // or, with expected, returning false at the first that differs
+  bool followActions(const LinkedBinaryTree &t, const vector<pair<double, double>> &starts,
+                     const string *expected, string *record) const
+  {
+    LinkedBinaryTree copy(t); // keep t's memory untouched
+    CompiledTree c(copy);
+    cartCentering env(INTEGRATOR, CONTROL_STEPS);
+    size_t k = 0;
+    for (auto &s : starts)
+    {
+      env.reset(s.first, s.second);
+      if (partially_observable)
+        copy.setMemory(0.0);
+      while (!env.terminal())
+      {
+        int action = c.evaluate(copy, env.getCartXPos(),
+                                partially_observable ? 0.0 : env.getCartXVel());
+        char a = action < 0 ? '<' : '>';
+        if (record != NULL)
+          record->push_back(a);
+        else if (k >= expected->size() || (*expected)[k] != a)
+          return false;
+        k++;
+        env.update(action);
+      }
+    }
+    return expected == NULL || k == expected->size();
+  }
+
+  bool partially_observable;
+  size_t max_entries; // entries in all buckets
+  size_t max_actions; // recorded actions of all entries
+  size_t max_bucket;  // entries of trees with memory per fingerprint
+  size_t entries;
+  size_t actions;
+  vector<pair<double, double>> probes;
+  vector<pair<double, double>> starts;
+  unordered_map<string, vector<Entry>> cache;
+  deque<string> order; // keys of cache, oldest first
+  long lookups;
+  long hits;
+  long verified; // hits of trees with memory, checked by replay
+  long rejected; // trees with memory whose replay differed
+};
+
+// per-generation diversity of a population, written as CSV: the number of
+// distinct tree structures (by a hash of the whole tree), of distinct behaviours
+// (by the fitness cache's fingerprint) and an estimate of the mean pairwise
+// distance 1 - J(A, B), with J the Jaccard similarity of the trees' sets of
+// subtrees. J is estimated by MinHash sketches of num_hashes minima per tree, and
+// the mean over all pairs by counting equal minima per sketch component, so a
+// generation costs O(nodes * num_hashes) rather than O(trees^2).
+class PopulationDiversity
+{
+public:
+  typedef LinkedBinaryTree::Node Node;
+
+  PopulationDiversity(const string &path, const FitnessCache &probes, int num_hashes = 64)
+      : out(path), probes(probes), num_hashes(num_hashes)
+  {
+    out << "generation,trees,unique_structures,unique_behaviours,mean_distance" << endl;
+  }
+
+  void record(int generation, const vector<LinkedBinaryTree> &trees)
+  {
+    unordered_set<uint64_t> structures;
+    unordered_set<string> behaviours;
+    vector<vector<uint64_t>> sketches;
+    for (auto &t : trees)
+    {
+      vector<uint64_t> subtrees;
+      if (t.root() != NULL)
+        structures.insert(hashSubtrees(t.root(), subtrees));
+      behaviours.insert(probes.fingerprint(t));
+      sketches.push_back(sketch(subtrees));
+    }
+    out << generation << "," << trees.size() << "," << structures.size() << ","
+        << behaviours.size() << "," << meanDistance(sketches) << endl;
+  }
+
+private:
+  static uint64_t mix(uint64_t x) // splitmix64 finalizer
+  {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  // hash of the subtree at v, appending the hash of every subtree below it
+  uint64_t hashSubtrees(const Node *v, vector<uint64_t> &subtrees) const
+  {
+    uint64_t h = hash<string>()(v->elt);
+    if (v->left != NULL)
+      h = mix(h ^ mix(hashSubtrees(v->left, subtrees)));
+    if (v->right != NULL)
+      h = mix(h + 0x632be59bd9b4e019ULL * hashSubtrees(v->right, subtrees));
+    subtrees.push_back(h);
+    return h;
+  }
+
+  vector<uint64_t> sketch(const vector<uint64_t> &subtrees) const
+  {
+    vector<uint64_t> minima(num_hashes, UINT64_MAX);
+    for (uint64_t s : subtrees)
+      for (int k = 0; k < num_hashes; k++)
+        minima[k] = min(minima[k], mix(s ^ (0x2545f4914f6cdd1dULL * (k + 1))));
+    return minima;
+  }
+
+  double meanDistance(const vector<vector<uint64_t>> &sketches) const
+  {
+    double n = sketches.size();
+    if (n < 2)
+      return 0.0;
+    double equal = 0; // pairs with equal minima, summed over components
+    unordered_map<uint64_t, long> counts;
+    for (int k = 0; k < num_hashes; k++)
+    {
+      counts.clear();
+      for (auto &s : sketches)
+        counts[s[k]]++;
+      for (auto &c : counts)
+        equal += 0.5 * c.second * (c.second - 1);
+    }
+    return 1.0 - equal / (num_hashes * 0.5 * n * (n - 1));
+  }
+
+  ofstream out;
+  const FitnessCache &probes;
+  int num_hashes;
+};
+
+// online k-nearest-neighbour model of fitness, used to skip simulating offspring
+// that would not survive. A tree is described by its action signs on the fitness
+// cache's probe states, its size and its depth; the distance between two trees is
+// the number of probes they disagree on plus weighted differences of size and
+// depth, and the prediction is the distance-weighted mean score of the k closest
+// of the last max_examples evaluated trees. A running mean of its absolute error
+// tells callers how far off a prediction may be.
+class SurrogateModel
+{
+public:
+  SurrogateModel(const FitnessCache &probes, int k = 5, int max_examples = 2000,
+                 double size_weight = 0.25, double depth_weight = 1.0)
+      : probes(probes), k(k), max_examples(max_examples), size_weight(size_weight),
+        depth_weight(depth_weight), next(0), error(0) {}
+
+  struct Features
+  {
+    vector<uint64_t> signs;
+    int size;
+    int depth;
+  };
+
+  Features features(const LinkedBinaryTree &t) const
+  {
+    string fp = probes.fingerprint(t);
+    Features f;
+    f.signs.assign((fp.size() + 7) / 8, 0);
+    memcpy(f.signs.data(), fp.data(), fp.size());
+    f.size = t.size();
+    f.depth = t.depth();
+    return f;
+  }
+
+  // true once there are enough examples to predict from
+  bool ready() const { return examples.size() >= 4 * k; }
+
+  double predict(const Features &f) const
+  {
+    // the k closest examples, kept sorted by distance
+    vector<pair<double, double>> nearest; // distance, score
+    for (auto &e : examples)
+    {
+      double d = distance(f, e.first);
+      if (nearest.size() == k && d >= nearest.back().first)
+        continue;
+      if (nearest.size() == k)
+        nearest.pop_back();
+      auto at = upper_bound(nearest.begin(), nearest.end(), make_pair(d, 0.0),
+                            [](const pair<double, double> &x, const pair<double, double> &y)
+                            { return x.first < y.first; });
+      nearest.insert(at, make_pair(d, e.second));
+    }
+    double sum = 0, weight = 0;
+    for (auto &n : nearest)
+    {
+      double w = 1.0 / (1.0 + n.first);
+      sum += w * n.second;
+      weight += w;
+    }
+    return weight > 0 ? sum / weight : 0.0;
+  }
+
+  // learn the score of an evaluated tree, replacing the oldest example when full
+  void add(const Features &f, double score)
+  {
+    if (examples.size() < max_examples)
+      examples.push_back(make_pair(f, score));
+    else
+      examples[next] = make_pair(f, score);
+    next = (next + 1) % max_examples;
+  }
+
+  // record the score of a tree whose score was predicted
+  void addError(double prediction, double score)
+  {
+    error += 0.1 * (fabs(prediction - score) - error);
+  }
+  double meanError() const { return error; }
+
+private:
+  double distance(const Features &x, const Features &y) const
+  {
+    int differ = 0;
+    for (size_t i = 0; i < x.signs.size(); i++)
+      differ += __builtin_popcountll(x.signs[i] ^ y.signs[i]);
+    return differ + size_weight * abs(x.size - y.size) + depth_weight * abs(x.depth - y.depth);
+  }
+
+  const FitnessCache &probes;
+  size_t k;
+  size_t max_examples;
+  double size_weight;
+  double depth_weight;
+  size_t next;
+  double error;
+  vector<pair<Features, double>> examples;
+};
+
+// per-generation record of the offspring screened by a SurrogateModel: how many
+// were simulated or skipped, and how well the model did on the simulated ones
+// (whether a tree beats the survival threshold, and the error of its score)
+class SurrogateReport
+{
+public:
+  SurrogateReport(const string &path) : out(path)
+  {
+    out << "generation,offspring,simulated,skipped,explored,predicted,correct,accuracy,mean_abs_error" << endl;
+    begin();
+  }
+
+  void begin() { offspring = skipped = explored = predicted = correct = 0, error = 0; }
+
+  void skip()
+  {
+    offspring++;
+    skipped++;
+  }
+
+  // an offspring that was simulated; with_prediction if the model predicted it
+  void simulate(bool exploring = false, bool with_prediction = false, double prediction = 0,
+                double score = 0, double threshold = 0)
+  {
+    offspring++;
+    explored += exploring;
+    if (!with_prediction)
+      return;
+    predicted++;
+    correct += (prediction >= threshold) == (score >= threshold);
+    error += fabs(prediction - score);
+  }
+
+  void end(int generation)
+  {
+    out << generation << "," << offspring << "," << offspring - skipped << "," << skipped
+        << "," << explored << "," << predicted << "," << correct << ","
+        << (predicted > 0 ? double(correct) / predicted : 0.0) << ","
+        << (predicted > 0 ? error / predicted : 0.0) << endl;
+    total_offspring += offspring;
+    total_skipped += skipped;
+    total_predicted += predicted;
+    total_correct += correct;
+    begin();
+  }
+
+  long getOffspring() const { return total_offspring; }
+  long getSkipped() const { return total_skipped; }
+  double getAccuracy() const { return total_predicted > 0 ? double(total_correct) / total_predicted : 0.0; }
+
+private:
+  ofstream out;
+  long offspring, skipped, explored, predicted, correct;
+  double error;
+  long total_offspring = 0, total_skipped = 0, total_predicted = 0, total_correct = 0;
+};
+
+// incremental evaluation of offspring. For every memory-free tree it evaluates,
+// it keeps a trace: the start states of its episodes and the value of each of its
+// nodes at every step. A child whose first parent has a trace runs on the same
+// start states; while its actions match the parent's, the states match too, so a
+// subtree it shares with the parent (the same nodes, see makeUnique) has the
+// value recorded in the parent's trace and only the child's own nodes, i.e. the
+// mutated subtree and its path to the root, are computed. From the first step
+// the action differs the child is simulated normally. Scores are those of
+// evaluate() on the parent's start states. All traces together hold at most
+// max_values values (256 MB by default); the traces of the lowest-scoring trees
+// are dropped first.
+class TraceCache
+{
+public:
+  typedef LinkedBinaryTree::Node Node;
+
+  TraceCache(bool partially_observable, size_t max_values = 1 << 25)
+      : partially_observable(partially_observable), max_values(max_values), stored(0),
+        children(0), computed(0), total(0), reused_steps(0), steps(0) {}
+
+  // evaluate memory-free tree t over num_episode episodes and record its trace
+  void evaluate(mt19937 &rng, LinkedBinaryTree &t, int num_episode)
+  {
+    auto found = traces.find(t.getParent1());
+    const Trace *parent = found != traces.end() ? &found->second : NULL;
+    if (parent != NULL && (int)parent->starts.size() != num_episode)
+      parent = NULL;
+
+    CompiledTree c(t, false);
+    int width = c.size();
+    // for each instruction, the register of the same node in the parent, or -1
+    vector<int> from(width, -1);
+    vector<int> own; // instructions computed while following the parent
+    for (int i = 0; i < width; i++)
+    {
+      if (parent != NULL)
+      {
+        auto it = parent->index.find(c.sources()[i]);
+        if (it != parent->index.end())
+          from[i] = it->second;
+      }
+      if (from[i] < 0)
+        own.push_back(i);
+    }
+    if (parent != NULL)
+      children++;
+
+    Trace trace;
+    trace.tree = t;
+    trace.width = width;
+    trace.root = c.rootIndex();
+    for (int i = 0; i < width; i++)
+      trace.index[c.sources()[i]] = i;
+    bool keep = true;
+
+    cartCentering env(INTEGRATOR, CONTROL_STEPS);
+    double mean_score = 0.0;
+    double mean_steps = 0.0;
+    for (int e = 0; e < num_episode; e++)
+    {
+      if (parent != NULL)
+        env.reset(parent->starts[e].first, parent->starts[e].second);
+      else
+        env.reset(rng);
+      trace.starts.push_back({env.getCartXPos(), env.getCartXVel()});
+      trace.begin.push_back(trace.values.size() / max(1, width));
+      bool following = parent != NULL;
+      size_t row = following ? parent->begin[e] : 0;
+      double episode_score = 0.0;
+      while (!env.terminal())
+      {
+        double a = env.getCartXPos();
+        double b = partially_observable ? 0.0 : env.getCartXVel();
+        double value;
+        if (following)
+        {
+          const double *prev = &parent->values[row * parent->width];
+          for (int i = 0; i < width; i++)
+            if (from[i] >= 0)
+              c.setValue(i, prev[from[i]]);
+          for (int i : own)
+            c.step(i, t, a, b);
+          value = c.values()[c.rootIndex()];
+          computed += own.size();
+          reused_steps++;
+          // the states differ from the next step on
+          following = (int(value) < 0) == (int(prev[parent->root]) < 0);
+          row++;
+        }
+        else
+        {
+          value = c.evaluate(t, a, b);
+          computed += width;
+        }
+        total += width;
+        steps++;
+        if (keep)
+        {
+          keep = trace.values.size() + width <= max_values;
+          if (keep)
+            trace.values.insert(trace.values.end(), c.values().begin(), c.values().end());
+        }
+        episode_score += env.update(int(value));
+      }
+      mean_score += episode_score;
+      mean_steps += env.getStep();
+    }
+    t.setScore(mean_score / num_episode);
+    t.setSteps(mean_steps / num_episode);
+    if (keep)
+    {
+      trace.score = t.getScore();
+      store(t.getId(), std::move(trace));
+    }
+  }
+
+  // drop the traces of trees that are not in population
+  void keep(const vector<LinkedBinaryTree> &population)
+  {
+    unordered_set<long> ids;
+    for (auto &t : population)
+      ids.insert(t.getId());
+    for (auto it = traces.begin(); it != traces.end();)
+    {
+      if (ids.count(it->first))
+        it++;
+      else
+      {
+        stored -= it->second.values.size();
+        it = traces.erase(it);
+      }
+    }
+  }
+
+  long getChildren() const { return children; }
+  long getComputed() const { return computed; }
+  long getTotal() const { return total; }
+  long getReusedSteps() const { return reused_steps; }
+  long getSteps() const { return steps; }
+
+private:
+  struct Trace
+  {
+    LinkedBinaryTree tree; // keeps the indexed nodes alive
+    unordered_map<const Node *, int> index; // register of each node
+    int width;
+    int root;                            // register of the root
+    double score;                        // of the tree, for eviction
+    vector<pair<double, double>> starts; // of each episode
+    vector<size_t> begin;                // first row of each episode
+    vector<double> values;               // width registers per step
+  };
+
+  // keep trace as the trace of tree id, dropping the lowest-scoring traces until
+  // all fit in max_values; trace itself is dropped if it scores lowest
+  void store(long id, Trace &&trace)
+  {
+    while (stored + trace.values.size() > max_values)
+    {
+      auto worst = traces.end();
+      for (auto it = traces.begin(); it != traces.end(); it++)
+        if (worst == traces.end() || it->second.score < worst->second.score)
+          worst = it;
+      if (worst == traces.end() || worst->second.score >= trace.score)
+        return;
+      stored -= worst->second.values.size();
+      traces.erase(worst);
+    }
+    stored += trace.values.size();
+    traces[id] = std::move(trace);
+  }
+
+  bool partially_observable;
+  size_t max_values; // of all traces together
+  size_t stored;     // values in traces
+  unordered_map<long, Trace> traces;
+  long children;     // evaluated from a parent's trace
+  long computed;     // node evaluations done
+  long total;        // node evaluations a full evaluation would do
+  long reused_steps; // steps that followed a parent's trajectory
+  long steps;
+};
+
+// exhaustive search over every tree of up to max_size nodes built from the GA's
+// op set and terminals. Candidates are pruned before any simulation: equal
+// canonical forms (children of + and * sorted, abs(abs(x)) = abs(x)), equal
+// values on a set of probe states for memory-free subtrees (so only the smallest
+// of equivalent subtrees is grown further), and finally equal behaviour as seen
+// by the fitness cache's fingerprint. The remaining trees are evaluated in
+// parallel on the same episodes.
+class EnumerativeSearch
+{
+public:
+  EnumerativeSearch(bool partially_observable, bool use_memory, size_t max_candidates = 500000)
+      : partially_observable(partially_observable), use_memory(use_memory),
+        max_candidates(max_candidates), generated(0), canonical_duplicates(0),
+        value_duplicates(0), behaviour_duplicates(0), evaluated(0)
+  {
+    cartCentering env;
+    mt19937 probe_rng(54321);
+    for (int i = 0; i < 32; i++)
+    {
+      probes.push_back({std::uniform_real_distribution<>{-env.getMaxX(), env.getMaxX()}(probe_rng),
+                        std::uniform_real_distribution<>{-env.getMaxV(), env.getMaxV()}(probe_rng)});
+      if (partially_observable)
+        probes.back().second = 0.0;
+    }
+  }
+
+  // return the best `keep` trees of up to max_size nodes, best first, each scored
+  // on num_episode episodes drawn from seed
+  vector<LinkedBinaryTree> run(int max_size, int num_episode, unsigned seed, int keep)
+  {
+    enumerate(max_size);
+
+    // one tree per behaviour
+    FitnessCache behaviour(partially_observable);
+    unordered_map<string, int> seen;
+    vector<LinkedBinaryTree> survivors;
+    for (auto &level : levels)
+      for (auto &c : level)
+      {
+        string key = behaviour.fingerprint(c.tree);
+        if (c.memory)
+          key += behaviour.episodeTrace(c.tree);
+        if (!seen.emplace(key, 1).second)
+        {
+          behaviour_duplicates++;
+          continue;
+        }
+        survivors.push_back(c.tree);
+      }
+
+    // evaluate in parallel; every tree sees the same episodes so that the result
+    // does not depend on the number of threads
+    evaluated = survivors.size();
+    int num_threads = std::max(1u, thread::hardware_concurrency());
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (int w = 0; w < num_threads; w++)
+      workers.push_back(thread([&]
+                               {
+        for (size_t i = next++; i < survivors.size(); i = next++)
+        {
+          mt19937 rng(seed);
+          CompiledTree c(survivors[i]);
+          runEpisodes(
+              rng, survivors[i], [&](double a, double b)
+              { return c.evaluate(survivors[i], a, b); },
+              num_episode, false, partially_observable);
+        } }));
+    for (auto &w : workers)
+      w.join();
+
+    stable_sort(survivors.begin(), survivors.end(), [](const LinkedBinaryTree &x, const LinkedBinaryTree &y)
+                { return x.getScore() > y.getScore() ||
+                         (x.getScore() == y.getScore() && x.size() < y.size()); });
+    if ((int)survivors.size() > keep)
+      survivors.erase(survivors.begin() + keep, survivors.end());
+    return survivors;
+  }
+
+  long getGenerated() const { return generated; }
+  long getCanonicalDuplicates() const { return canonical_duplicates; }
+  long getValueDuplicates() const { return value_duplicates; }
+  long getBehaviourDuplicates() const { return behaviour_duplicates; }
+  long getEvaluated() const { return evaluated; }
+
+private:
+  struct Candidate
+  {
+    LinkedBinaryTree tree;
+    string canon;
+    vector<double> values; // on the probes, only for memory-free trees
+    bool memory;
+  };
+
+  void enumerate(int max_size)
+  {
+    static const vector<string> unary = {"abs", "write"};
+    static const vector<string> binary = {"+", "-", "*", "/", ">"};
+    levels.assign(max_size + 1, vector<Candidate>());
+    vector<string> terminals = {"a", "b"};
+    if (use_memory)
+      terminals.push_back("read");
+    for (auto &e : terminals)
+      add(1, e, NULL, NULL);
+    for (int size = 2; size <= max_size; size++)
+    {
+      for (auto &op : unary)
+      {
+        if (op == "write" && !use_memory)
+          continue;
+        for (size_t i = 0; i < levels[size - 1].size(); i++)
+          add(size, op, &levels[size - 1][i], NULL);
+      }
+      for (auto &op : binary)
+        for (int ls = 1; ls < size - 1; ls++)
+        {
+          int rs = size - 1 - ls;
+          for (size_t i = 0; i < levels[ls].size(); i++)
+            for (size_t j = 0; j < levels[rs].size(); j++)
+              add(size, op, &levels[ls][i], &levels[rs][j]);
+        }
+    }
+  }
+
+  // build op(l, r) (or a leaf when l is NULL) and keep it if it is new
+  void add(int size, const string &op, const Candidate *l, const Candidate *r)
+  {
+    if (total >= max_candidates)
+      return;
+    generated++;
+    Candidate c;
+    c.memory = op == "read" || op == "write" || (l && l->memory) || (r && r->memory);
+
+    // canonical form
+    if (l == NULL)
+      c.canon = op;
+    else if (r == NULL)
+    {
+      if (op == "abs" && l->canon.compare(0, 4, "abs(") == 0)
+        c.canon = l->canon;
+      else
+        c.canon = op + "(" + l->canon + ")";
+    }
+    else
+    {
+      const string *x = &l->canon, *y = &r->canon;
+      // the order of the operands only matters if they can see each other's writes
+      if ((op == "+" || op == "*") && !l->memory && !r->memory && *y < *x)
+        swap(x, y);
+      c.canon = "(" + *x + " " + op + " " + *y + ")";
+    }
+    if (!canonical.insert(c.canon).second)
+    {
+      canonical_duplicates++;
+      return;
+    }
+
+    // values on the probes, computed like evalOp does at run time
+    if (!c.memory)
+    {
+      static LinkedBinaryTree scratch;
+      c.values.resize(probes.size());
+      for (size_t k = 0; k < probes.size(); k++)
+      {
+        if (l == NULL)
+          c.values[k] = op == "a" ? probes[k].first : probes[k].second;
+        else
+          c.values[k] = evalOp(op, scratch, l->values[k], r ? r->values[k] : 0.0);
+      }
+      string key(reinterpret_cast<const char *>(c.values.data()), c.values.size() * sizeof(double));
+      if (!observed.insert(key).second)
+      {
+        value_duplicates++;
+        return;
+      }
+    }
+
+    c.tree.addRoot(op);
+    if (l != NULL)
+      c.tree.addLeftChild(c.tree.root(), l->tree.root());
+    if (r != NULL)
+      c.tree.addRightChild(c.tree.root(), r->tree.root());
+    c.tree.setBirth(-1, BORN_ENUMERATED);
+    levels[size].push_back(c);
+    total++;
+  }
+
+  bool partially_observable;
+  bool use_memory;
+  size_t max_candidates;
+  size_t total = 0;
+  vector<pair<double, double>> probes;
+  vector<vector<Candidate>> levels; // candidates by number of nodes
+  unordered_set<string> canonical;
+  unordered_set<string> observed;
+  long generated;
+  long canonical_duplicates;
+  long value_duplicates;
+  long behaviour_duplicates;
+  long evaluated;
+};
+
+// population kept out of core: the programs of a generation (see encodeProgram)
+// in a file that is read through mmap, each stored as a 4-byte length and its
+// bytes. Only the offset, score, steps and generation of each tree are held in
+// memory, 24 bytes per tree. The next generation is written to a second file
+// while the current one is still mapped, then renamed over it.
+class PopulationFile
+{
+public:
+  PopulationFile(const string &path) : path(path), out(NULL), fd(-1), data(NULL), length(0) {}
+  ~PopulationFile()
+  {
+    unmap();
+    if (out != NULL)
+      fclose(out);
+  }
+
+  // start writing the next generation
+  void beginWrite()
+  {
+    out = fopen((path + ".next").c_str(), "wb");
+    if (out == NULL)
+      fail("cannot write ", path + ".next");
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    written = 0;
+    next.clear();
+  }
+
+  // append a tree to the next generation; score is nan for a tree still to be
+  // evaluated
+  void append(const char *program, uint32_t size, int generation, double score = NAN,
+              float steps = 0)
+  {
+    fwrite(&size, sizeof(size), 1, out);
+    fwrite(program, 1, size, out);
+    next.push_back({written, score, steps, generation});
+    written += sizeof(size) + size;
+  }
+  void append(const string &program, int generation)
+  {
+    append(program.data(), program.size(), generation);
+  }
+  // append tree i of the current generation as it is, with its score
+  void copy(size_t i)
+  {
+    uint32_t size;
+    const char *p = program(i, size);
+    append(p, size, trees[i].generation, trees[i].score, trees[i].steps);
+  }
+
+  // make the next generation the current one
+  void endWrite()
+  {
+    if (fclose(out) != 0)
+      fail("cannot write ", path + ".next");
+    out = NULL;
+    unmap();
+    if (rename((path + ".next").c_str(), path.c_str()) != 0)
+      fail("cannot rename ", path + ".next");
+    trees.swap(next);
+    next = vector<Tree>();
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      fail("cannot read ", path);
+    length = written;
+    if (length > 0)
+    {
+      data = (char *)mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED)
+        fail("cannot map ", path);
+      madvise(data, length, MADV_SEQUENTIAL);
+    }
+  }
+
+  size_t size() const { return trees.size(); }
+  const char *program(size_t i, uint32_t &size) const
+  {
+    const char *p = data + trees[i].offset;
+    memcpy(&size, p, sizeof(size));
+    return p + sizeof(size);
+  }
+  LinkedBinaryTree decode(size_t i) const
+  {
+    uint32_t size;
+    const char *p = program(i, size);
+    LinkedBinaryTree t = decodeProgram(string(p, size));
+    t.setGeneration(trees[i].generation);
+    t.setScore(trees[i].score);
+    t.setSteps(trees[i].steps);
+    return t;
+  }
+  bool evaluated(size_t i) const { return !isnan(trees[i].score); }
+  double getScore(size_t i) const { return trees[i].score; }
+  void setScore(size_t i, double score, double steps)
+  {
+    trees[i].score = score;
+    trees[i].steps = steps;
+  }
+
+  // let the kernel drop the pages of trees [begin, end) from memory
+  void release(size_t begin, size_t end) const
+  {
+    if (begin >= end)
+      return;
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t from = (trees[begin].offset + page - 1) / page * page;
+    uint64_t to = end < trees.size() ? trees[end].offset / page * page : length;
+    if (from < to)
+      madvise(data + from, to - from, MADV_DONTNEED);
+  }
+
+  uint64_t bytes() const { return length; }
+
+private:
+  struct Tree
+  {
+    uint64_t offset;
+    double score;
+    float steps;
+    int generation;
+  };
+
+  void fail(const string &what, const string &file)
+  {
+    cerr << what << file << endl;
+    exit(1);
+  }
+
+  void unmap()
+  {
+    if (data != NULL)
+      munmap(data, length);
+    if (fd >= 0)
+      close(fd);
+    data = NULL;
+    fd = -1;
+  }
+
+  string path;
+  FILE *out;
+  uint64_t written;
+  int fd;
+  char *data;
+  size_t length;
+  vector<Tree> trees;
+  vector<Tree> next;
+};
+
+// the GA of main (evaluate the new trees, keep the better half, refill with
+// mutated copies of survivors) on num_tree trees kept in a PopulationFile at
+// path. Evaluation streams over the file in chunks of chunk_size trees on all
+// cores, decoding one tree at a time; selection only sorts the score array;
+// survivors are copied to the next generation's file as bytes. Prints the same
+// CSV lines as main and returns the best tree of the last generation.
+LinkedBinaryTree runOutOfCore(long num_tree, const string &path, int max_generations,
+                              int num_episode, int max_depth_initial, int max_depth,
+                              bool partially_observable, unsigned seed, size_t chunk_size = 4096)
+{
+  PopulationFile population(path);
+  population.beginWrite();
+  for (long i = 0; i < num_tree; i += chunk_size)
+  {
+    // random trees are drawn chunk by chunk too, then written in order
+    vector<string> programs(min<long>(chunk_size, num_tree - i));
+    forEachChunk(programs.size(), 256, seed, -1 - int(i / long(chunk_size)),
+                 [&](size_t begin, size_t end, mt19937 &rng)
+                 {
+                   for (size_t k = begin; k < end; k++)
+                     programs[k] = encodeProgram(
+                         createRandExpressionTree(max_depth_initial, rng, partially_observable));
+                 });
+    for (auto &p : programs)
+      population.append(p, 0);
+  }
+  population.endWrite();
+
+  LinkedBinaryTree best;
+  vector<uint32_t> order(num_tree);
+  for (int g = 1; g <= max_generations; g++)
+  {
+    forEachChunk(num_tree, chunk_size, seed, g,
+                 [&](size_t begin, size_t end, mt19937 &rng)
+                 {
+                   EvalStats stats;
+                   for (size_t i = begin; i < end; i++)
+                   {
+                     if (population.evaluated(i))
+                       continue;
+                     LinkedBinaryTree t = population.decode(i);
+                     evaluateCompiled(rng, t, num_episode, false, partially_observable, stats);
+                     population.setScore(i, t.getScore(), t.getSteps());
+                   }
+                   population.release(begin, end);
+                 });
+
+    // keep the better half, best last
+    for (uint32_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    size_t half = num_tree / 2;
+    auto worse = [&](uint32_t x, uint32_t y)
+    { return population.getScore(x) < population.getScore(y); };
+    nth_element(order.begin(), order.begin() + half, order.end(), worse);
+    sort(order.begin() + half, order.end(), worse);
+    best = population.decode(order.back());
+    std::cout << g << "," << best.getScore() << "," << best.getSteps() << ","
+              << best.size() << "," << best.depth() << std::endl;
+    if (g == max_generations)
+      break;
+
+    // next generation: the survivors, then their children made chunk by chunk
+    population.beginWrite();
+    for (size_t i = half; i < order.size(); i++)
+      population.copy(order[i]);
+    long num_children = half;
+    for (long i = 0; i < num_children; i += chunk_size)
     {
-      return A.size() > B.size();
+      vector<string> programs(min<long>(chunk_size, num_children - i));
+      forEachChunk(programs.size(), 256, seed, g * 65536 + int(i / long(chunk_size)),
+                   [&](size_t begin, size_t end, mt19937 &rng)
+                   {
+                     for (size_t k = begin; k < end; k++)
+                     {
+                       LinkedBinaryTree child =
+                           population.decode(order[randInt(rng, half, num_tree - 1)]);
+                       child.deleteSubtreeMutator(rng);
+                       child.addSubtreeMutator(rng, max_depth, partially_observable);
+                       programs[k] = encodeProgram(child);
+                     }
+                   });
+      for (auto &p : programs)
+        population.append(p, g);
     }
-    else
+    population.endWrite();
+  }
+  return best;
+}
+
+// outcome of validating a controller on a set of start states
+struct ValidationStats
+{
+  long episodes = 0;
+  long successes = 0; // episodes ending within NEAR_ORIGIN of the origin
+  double steps = 0;   // sums of steps, squared steps and reward
+  double steps2 = 0;
+  double reward = 0;
+  long excluded = 0; // start states that were already terminal
+
+  void add(bool success, int episode_steps, double episode_reward)
+  {
+    episodes++;
+    successes += success;
+    steps += episode_steps;
+    steps2 += double(episode_steps) * episode_steps;
+    reward += episode_reward;
+  }
+  void add(const ValidationStats &s)
+  {
+    episodes += s.episodes;
+    successes += s.successes;
+    steps += s.steps;
+    steps2 += s.steps2;
+    reward += s.reward;
+    excluded += s.excluded;
+  }
+  double successRate() const { return episodes > 0 ? double(successes) / episodes : 0.0; }
+  double meanSteps() const { return episodes > 0 ? steps / episodes : 0.0; }
+  // 95% Wilson interval of the success rate
+  pair<double, double> successInterval() const
+  {
+    if (episodes == 0)
+      return {0.0, 1.0};
+    double z = 1.96, n = episodes, p = successRate();
+    double center = (p + z * z / (2 * n)) / (1 + z * z / n);
+    double half = z * sqrt(p * (1 - p) / n + z * z / (4 * n * n)) / (1 + z * z / n);
+    return {center - half, center + half};
+  }
+  // half width of the 95% normal interval of the mean steps
+  double stepsHalfWidth() const
+  {
+    if (episodes < 2)
+      return 0.0;
+    double mean = meanSteps();
+    double var = (steps2 - episodes * mean * mean) / (episodes - 1);
+    return 1.96 * sqrt(max(0.0, var) / episodes);
+  }
+};
+
+// run tree t from grid_size x grid_size start states at the centres of the cells
+// of the start box (MIN_VAR_INI..MAX_VAR_INI in x and v), then from num_random
+// uniform start states in the same box, on all cores. Like reset(rng), start
+// states that are already terminal are not run: grid cells whose centre is one
+// are skipped and random ones are drawn again, and both are counted as excluded.
+// Memory is zeroed at the start of every episode so that each is independent.
+// Fills grid and random with their totals and writes per cell of the grid the
+// episodes of both sets that started in it, their success rate, mean steps and
+// excluded starts, to map_path as CSV.
+void validateController(const LinkedBinaryTree &t, bool partially_observable, int grid_size,
+                        long num_random, unsigned seed, const string &map_path,
+                        ValidationStats &grid, ValidationStats &random)
+{
+  cartCentering box;
+  double lo = box.getMinVarIni(), hi = box.getMaxVarIni();
+  double near = box.getNearOrigin();
+  double cell = (hi - lo) / grid_size;
+  size_t num_grid = size_t(grid_size) * grid_size;
+  vector<ValidationStats> cells(num_grid);
+  grid = ValidationStats();
+  random = ValidationStats();
+  mutex merge;
+  auto cellOf = [&](double x, double v)
+  {
+    int cx = min(grid_size - 1, int((x - lo) / cell));
+    int cv = min(grid_size - 1, int((v - lo) / cell));
+    return cv * grid_size + cx;
+  };
+  ValidationStats excluded; // one excluded start
+  excluded.excluded = 1;
+
+  forEachChunk(num_grid + size_t(num_random), 1024, seed, 0,
+               [&](size_t begin, size_t end, mt19937 &rng)
+               {
+                 LinkedBinaryTree tree(t);
+                 CompiledTree c(tree);
+                 cartCentering env(INTEGRATOR, CONTROL_STEPS);
+                 uniform_real_distribution<> start(lo, hi);
+                 ValidationStats chunk_grid, chunk_random;
+                 vector<pair<int, ValidationStats>> chunk_cells;
+                 for (size_t k = begin; k < end; k++)
+                 {
+                   ValidationStats &totals = k < num_grid ? chunk_grid : chunk_random;
+                   double x, v;
+                   while (true)
+                   {
+                     if (k < num_grid)
+                     {
+                       x = lo + (k % grid_size + 0.5) * cell;
+                       v = lo + (k / grid_size + 0.5) * cell;
+                     }
+                     else
+                     {
+                       x = start(rng);
+                       v = start(rng);
+                     }
+                     env.reset(x, v);
+                     if (!env.terminal())
+                       break;
+                     totals.excluded++;
+                     chunk_cells.push_back({cellOf(x, v), excluded});
+                     if (k < num_grid)
+                       break;
+                   }
+                   if (env.terminal())
+                     continue;
+                   tree.setMemory(0.0);
+                   double reward = 0;
+                   while (!env.terminal())
+                   {
+                     int action = c.evaluate(tree, env.getCartXPos(),
+                                             partially_observable ? 0.0 : env.getCartXVel());
+                     reward += env.update(action);
+                   }
+                   bool success = abs(env.getCartXPos()) <= near && abs(env.getCartXVel()) <= near;
+                   totals.add(success, env.getStep(), reward);
+                   ValidationStats one;
+                   one.add(success, env.getStep(), reward);
+                   chunk_cells.push_back({cellOf(x, v), one});
+                 }
+                 lock_guard<mutex> hold(merge);
+                 grid.add(chunk_grid);
+                 random.add(chunk_random);
+                 for (auto &entry : chunk_cells)
+                   cells[entry.first].add(entry.second);
+               });
+
+  ofstream out(map_path);
+  out << "x_lo,x_hi,v_lo,v_hi,episodes,success_rate,mean_steps,excluded" << endl;
+  for (int cv = 0; cv < grid_size; cv++)
+    for (int cx = 0; cx < grid_size; cx++)
     {
-      return A.getScore() < B.getScore();
+      const ValidationStats &s = cells[cv * grid_size + cx];
+      out << lo + cx * cell << "," << lo + (cx + 1) * cell << "," << lo + cv * cell << ","
+          << lo + (cv + 1) * cell << "," << s.episodes << "," << s.successRate() << ","
+          << s.meanSteps() << "," << s.excluded << endl;
+    }
+}
+
+// write tree t as a standalone C++ header declaring
+//   struct <name>_memory                        the four read/write cells
+//   constexpr double <name>(a, b, memory &)     the tree's value
+//   constexpr int <name>_action(a, b, memory &) the sign of the force, -1 or 1
+// The function is straight-line code over the tree's compiled instructions with
+// no allocation, library calls or recursion, and returns the same bits as
+// evaluateExpression. It must not be built with -ffast-math, which breaks the
+// inf/nan test that stands in for isfinite.
+void exportController(const LinkedBinaryTree &t, const string &name, ostream &out)
+{
+  typedef CompiledTree::Instr Instr;
+  CompiledTree ct(t);
+  const vector<Instr> &code = ct.instructions();
+  string guard = name;
+  transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+  string mem = "m.cell";
+  // getMemory() sums the cells from 0 in order, then divides by their count
+  string read = "((((0.0 + " + mem + "[0]) + " + mem + "[1]) + " + mem + "[2]) + " + mem + "[3]) / 4";
+
+  out << "// controller exported by the cart centering GP, do not edit" << endl;
+  out << "// generation " << t.getGeneration() << ", fitness " << t.getScore()
+      << ", steps " << t.getSteps() << ", size " << t.size() << ", depth " << t.depth() << endl;
+  out << "// ";
+  t.printExpression(t.root(), out);
+  out << endl;
+  out << "#ifndef " << guard << "_H" << endl;
+  out << "#define " << guard << "_H" << endl << endl;
+  out << "// read returns the mean of the cells, write sets them all; zero them where" << endl;
+  out << "// the GP did: before every episode when partially observable, else once" << endl;
+  out << "struct " << name << "_memory" << endl;
+  out << "{" << endl;
+  out << "  double cell[4] = {0.0, 0.0, 0.0, 0.0};" << endl;
+  out << "};" << endl << endl;
+  out << "// 0 in place of inf and nan, as evalOp does" << endl;
+  out << "constexpr double " << name << "_finite(double x) { return x - x == 0 ? x : 0.0; }" << endl << endl;
+  out << "constexpr double " << name << "(double a, double b, " << name << "_memory &m)" << endl;
+  out << "{" << endl;
+  out << "  (void)a;" << endl;
+  out << "  (void)b;" << endl;
+  out << "  (void)m;" << endl;
+  out << setprecision(17);
+  for (int i = 0; i < (int)code.size(); i++)
+  {
+    const Instr &in = code[i];
+    string x = in.left >= 0 ? "r" + to_string(in.left) : "0.0";
+    string y = in.right >= 0 ? "r" + to_string(in.right) : "0.0";
+    out << "  const double r" << i << " = ";
+    switch (in.op)
+    {
+    case OP_A:
+      out << "a";
+      break;
+    case OP_B:
+      out << "b";
+      break;
+    case OP_CONST:
+    {
+      ostringstream v;
+      v << setprecision(17) << in.value;
+      out << v.str();
+      if (v.str().find_first_of(".e") == string::npos)
+        out << ".0";
+      break;
+    }
+    case OP_ADD:
+      out << name << "_finite(" << x << " + " << y << ")";
+      break;
+    case OP_SUB:
+      out << name << "_finite(" << x << " - " << y << ")";
+      break;
+    case OP_MUL:
+      out << name << "_finite(" << x << " * " << y << ")";
+      break;
+    case OP_DIV: // x / 0 is inf or nan, so 0; keeps constant evaluation legal
+      out << "(" << y << " == 0 ? 0.0 : " << name << "_finite(" << x << " / " << y << "))";
+      break;
+    case OP_GT:
+      out << "(" << x << " > " << y << " ? 1.0 : -1.0)";
+      break;
+    case OP_ABS: // as fabs, also for -0
+      out << name << "_finite(" << x << " < 0 ? -" << x << " : (" << x << " == 0 ? 0.0 : " << x << "))";
+      break;
+    case OP_READ:
+      out << name << "_finite(" << read << ")";
+      break;
+    case OP_WRITE:
+      out << name << "_finite(" << x << ");" << endl;
+      out << "  " << mem << "[0] = " << mem << "[1] = " << mem << "[2] = " << mem << "[3] = " << x;
+      break;
+    default:
+      out << "0.0";
     }
+    out << ";" << endl;
   }
-};
+  out << "  return " << (ct.rootIndex() >= 0 ? "r" + to_string(ct.rootIndex()) : "0.0") << ";" << endl;
+  out << "}" << endl << endl;
+  out << "// the GP's action is int(value) < 0, i.e. value <= -1 for any value it can take" << endl;
+  out << "constexpr int " << name << "_action(double a, double b, " << name << "_memory &m)" << endl;
+  out << "{" << endl;
+  out << "  return " << name << "(a, b, m) <= -1.0 ? -1 : 1;" << endl;
+  out << "}" << endl << endl;
+  out << "#endif" << endl;
+}
+
+// write a benchmark for the controller exported under name to header. It holds
+// num_sequence runs of sequence_length random states (memory zeroed before each,
+// b = 0 when partially observable) with the values evaluateExpression gave for
+// them, checks that the exported function returns the same bits, then times
+// every call and prints the median, 99th percentile and worst latency. Given a
+// budget in ns as argument it fails if the worst call exceeds it.
+void exportHarness(const LinkedBinaryTree &tree, const string &name, const string &header,
+                   bool partially_observable, ostream &out, int num_sequence = 64,
+                   int sequence_length = 64, unsigned seed = 1)
+{
+  cartCentering env;
+  mt19937 rng(seed);
+  uniform_real_distribution<> disX(-env.getMaxX(), env.getMaxX());
+  uniform_real_distribution<> disV(-env.getMaxV(), env.getMaxV());
+  LinkedBinaryTree t(tree);
 
-void crossover(LinkedBinaryTree &treeA, LinkedBinaryTree &treeB, mt19937 &rng, int maxAllowedDepth)
+  out << "// benchmark and equivalence check for " << header << ", generated by the cart centering GP" << endl;
+  out << "// build: g++ -O2 -std=c++17 <this file> -o bench && ./bench [budget_ns]" << endl;
+  out << "#include <algorithm>" << endl;
+  out << "#include <chrono>" << endl;
+  out << "#include <cstdio>" << endl;
+  out << "#include <cstdlib>" << endl;
+  out << "#include <cstring>" << endl;
+  out << "#include <vector>" << endl << endl;
+  out << "#include \"" << header << "\"" << endl << endl;
+  out << "static const int NUM_SEQUENCE = " << num_sequence << ";" << endl;
+  out << "static const int SEQUENCE_LENGTH = " << sequence_length << ";" << endl;
+  out << "// a, b, value" << endl;
+  out << "static const double cases[NUM_SEQUENCE * SEQUENCE_LENGTH][3] = {" << endl;
+  out << setprecision(17);
+  for (int s = 0; s < num_sequence; s++)
+  {
+    t.setMemory(0.0);
+    for (int i = 0; i < sequence_length; i++)
+    {
+      double a = disX(rng);
+      double b = partially_observable ? 0.0 : disV(rng);
+      out << "    {" << a << ", " << b << ", " << t.evaluateExpression(a, b) << "}," << endl;
+    }
+  }
+  out << "};" << endl << endl;
+  out << "// the function can run at compile time" << endl;
+  out << "constexpr double probe()" << endl;
+  out << "{" << endl;
+  out << "  " << name << "_memory m;" << endl;
+  out << "  return " << name << "(0.25, -0.5, m);" << endl;
+  out << "}" << endl;
+  out << "static_assert(probe() == probe(), \"not a constant expression\");" << endl << endl;
+  out << R"(int main(int argc, char **argv)
 {
-  vector<LinkedBinaryTree::Node *> candidatesA;
+  long mismatches = 0;
+  for (int s = 0; s < NUM_SEQUENCE; s++)
+  {
+    )" << name << R"(_memory m;
+    for (int i = 0; i < SEQUENCE_LENGTH; i++)
+    {
+      const double *c = cases[s * SEQUENCE_LENGTH + i];
+      double v = )" << name << R"((c[0], c[1], m);
+      if (memcmp(&v, &c[2], sizeof(double)) != 0)
+      {
+        if (mismatches++ < 10)
+          printf("mismatch in sequence %d step %d: %.17g instead of %.17g\n", s, i, v, c[2]);
+      }
+    }
+  }
+  printf("equivalence: %ld of %d calls differ\n", mismatches, NUM_SEQUENCE * SEQUENCE_LENGTH);
+
+  typedef std::chrono::steady_clock clock;
+  const int REPEAT = 100;
+  const int n = NUM_SEQUENCE * SEQUENCE_LENGTH;
+  std::vector<double> ns, overhead;
+  ns.reserve((size_t)REPEAT * n);
+  overhead.reserve((size_t)REPEAT * n);
+  volatile double sink = 0;
+  for (int r = 0; r < REPEAT; r++)
   {
-    stack<LinkedBinaryTree::Node *> sA;
-    sA.push(treeA.root());
-    while (!sA.empty())
+    )" << name << R"(_memory m;
+    for (int i = 0; i < n; i++)
     {
-      LinkedBinaryTree::Node *cur = sA.top();
-      sA.pop();
-      if (cur->par != nullptr)
-        candidatesA.push_back(cur);
-      if (cur->left != nullptr)
-        sA.push(cur->left);
-      if (cur->right != nullptr)
-        sA.push(cur->right);
+      volatile double a = cases[i][0], b = cases[i][1];
+      auto t0 = clock::now();
+      sink = )" << name << R"((a, b, m);
+      auto t1 = clock::now();
+      auto t2 = clock::now();
+      ns.push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+      overhead.push_back(std::chrono::duration<double, std::nano>(t2 - t1).count());
     }
   }
+  (void)sink;
+  std::sort(ns.begin(), ns.end());
+  std::sort(overhead.begin(), overhead.end());
+  // the clock's own cost is taken out at its median
+  double clock_ns = overhead[overhead.size() / 2];
+  auto at = [&](double q)
+  { return std::max(0.0, ns[(size_t)(q * (ns.size() - 1))] - clock_ns); };
+  double worst = std::max(0.0, ns.back() - clock_ns);
+  printf("latency over %zu calls (ns, clock overhead %.1f removed): median %.1f, p99 %.1f, p99.99 %.1f, worst %.1f\n",
+         ns.size(), clock_ns, at(0.5), at(0.99), at(0.9999), worst);
+  if (argc > 1)
+  {
+    double budget = atof(argv[1]);
+    printf("budget %.1f ns: %s\n", budget, worst <= budget ? "met" : "EXCEEDED");
+    if (worst > budget)
+      return 1;
+  }
+  return mismatches == 0 ? 0 : 1;
+}
+)";
+}
+
+// number of num_steps random observations, fed in sequence so memory carries
+// over, for which the compact program of tree loaded by ControllerProgram (as
+// gp_controller_load does) gives other bits than the tree's compiled form the GP
+// scores with; -1 if the program does not load
+long checkProgram(const LinkedBinaryTree &tree, const string &program, bool partially_observable,
+                  int num_steps = 4096, unsigned seed = 1)
+{
+  ControllerProgram loaded;
+  if (!loaded.load(reinterpret_cast<const unsigned char *>(program.data()), program.size()))
+    return -1;
+  LinkedBinaryTree t(tree);
+  t.setMemory(0.0);
+  CompiledTree compiled(t);
+  double memory[MEMORY_CELLS] = {0, 0, 0, 0};
+  cartCentering env;
+  mt19937 rng(seed);
+  uniform_real_distribution<> disX(-env.getMaxX(), env.getMaxX());
+  uniform_real_distribution<> disV(-env.getMaxV(), env.getMaxV());
+  long mismatches = 0;
+  for (int i = 0; i < num_steps; i++)
+  {
+    double a = disX(rng);
+    double b = partially_observable ? 0.0 : disV(rng);
+    double expected = compiled.evaluate(t, a, b);
+    double value = loaded.evaluate(a, b, memory);
+    if (memcmp(&expected, &value, sizeof(double)) != 0)
+      mismatches++;
+  }
+  return mismatches;
+}
 
-  vector<LinkedBinaryTree::Node *> candidatesB;
+class LexLessThan // use the class to achieve the operator
+{
+public:
+  bool operator()(const LinkedBinaryTree &A, const LinkedBinaryTree &B) const
   {
-    stack<LinkedBinaryTree::Node *> sB;
-    sB.push(treeB.root());
-    while (!sB.empty())
+    if (fabs(A.getScore() - B.getScore()) < 0.01)
+    {
+      return A.size() > B.size();
+    }
+    else
     {
-      LinkedBinaryTree::Node *cur = sB.top();
-      sB.pop();
-      if (cur->par != nullptr)
-        candidatesB.push_back(cur);
-      if (cur->left != nullptr)
-        sB.push(cur->left);
-      if (cur->right != nullptr)
-        sB.push(cur->right);
+      return A.getScore() < B.getScore();
     }
   }
+};
+
+// exchange random subtrees of treeA and treeB, return false if nothing changed
+bool crossover(LinkedBinaryTree &treeA, LinkedBinaryTree &treeB, mt19937 &rng, int maxAllowedDepth)
+{
+  LinkedBinaryTree::SlotList slA = treeA.slots(true);
+  vector<int> candidatesA;
+  for (int i = 0; i < (int)slA.size(); i++)
+    if (slA[i].parent >= 0)
+      candidatesA.push_back(i);
+
+  LinkedBinaryTree::SlotList slB = treeB.slots(true);
+  vector<int> candidatesB;
+  for (int i = 0; i < (int)slB.size(); i++)
+    if (slB[i].parent >= 0)
+      candidatesB.push_back(i);
 
   if (candidatesA.empty() || candidatesB.empty())
-    return;
+    return false;
 
   int indexA = randInt(rng, 0, candidatesA.size() - 1);
   int indexB = randInt(rng, 0, candidatesB.size() - 1);
-  LinkedBinaryTree::Node *nodeA = candidatesA[indexA];
-  LinkedBinaryTree::Node *nodeB = candidatesB[indexB];
-  LinkedBinaryTree::Node *parentA = nodeA->par;
-  LinkedBinaryTree::Node *parentB = nodeB->par;
+  int slotA = candidatesA[indexA];
+  int slotB = candidatesB[indexB];
 
-  // record the old pointers
-  LinkedBinaryTree::Node *oldA = nodeA;
-  LinkedBinaryTree::Node *oldB = nodeB;
+  // hold on to both subtrees while they are moved between the trees
+  LinkedBinaryTree::Node *nodeA = LinkedBinaryTree::retain(slA[slotA].v);
+  LinkedBinaryTree::Node *nodeB = LinkedBinaryTree::retain(slB[slotB].v);
 
   // exchange the subtrees
-  if (parentA->left == nodeA)
-    parentA->left = nodeB;
-  if (parentA->right == nodeA)
-    parentA->right = nodeB;
-  if (parentB->left == nodeB)
-    parentB->left = nodeA;
-  if (parentB->right == nodeB)
-    parentB->right = nodeA;
-  nodeB->par = parentA;
-  nodeA->par = parentB;
+  treeA.replaceSubtree(slA, slotA, nodeB);
+  treeB.replaceSubtree(slB, slotB, nodeA);
 
   // check for the max depth
   int depthA = treeA.depth();
   int depthB = treeB.depth();
+  bool changed = true;
   if (depthA > maxAllowedDepth || depthB > maxAllowedDepth)
   {
     // if the depth is too large, then revert the changes
-    if (parentA->left == nodeB)
-      parentA->left = nodeA;
-    if (parentA->right == nodeB)
-      parentA->right = nodeA;
-    if (parentB->left == nodeA)
-      parentB->left = nodeB;
-    if (parentB->right == nodeA)
-      parentB->right = nodeB;
-    nodeA->par = parentA;
-    nodeB->par = parentB;
+    treeA.replaceSubtree(slA, slotA, nodeA);
+    treeB.replaceSubtree(slB, slotB, nodeB);
+    changed = false;
+  }
+  LinkedBinaryTree::release(nodeA);
+  LinkedBinaryTree::release(nodeB);
+  return changed;
+}
+
+// crossover points of a parent, computed once per generation: its non-root nodes
+// with their depth, and the same nodes ordered by the height of their subtree
+struct CrossoverIndex
+{
+  LinkedBinaryTree::SlotList slots;
+  vector<int> points;   // slots that can receive a subtree
+  vector<int> byHeight; // slots that can be given away, by increasing height
+  vector<int> height;   // of the subtree at each slot
+
+  CrossoverIndex(const LinkedBinaryTree &t)
+  {
+    slots = t.slots(true);
+    height.assign(slots.size(), 0);
+    // slots lists parents before children, so walk it backwards
+    for (int i = slots.size() - 1; i > 0; i--)
+    {
+      int p = slots[i].parent;
+      height[p] = std::max(height[p], height[i] + 1);
+    }
+    for (int i = 1; i < (int)slots.size(); i++)
+      points.push_back(i);
+    byHeight = points;
+    stable_sort(byHeight.begin(), byHeight.end(), [this](int x, int y)
+                { return height[x] < height[y]; });
+  }
+
+  // the slots from the root to slot i, re-indexed, for replaceSubtree
+  LinkedBinaryTree::SlotList pathTo(int i) const
+  {
+    LinkedBinaryTree::SlotList path;
+    for (; i >= 0; i = slots[i].parent)
+      path.push_back(slots[i]);
+    reverse(path.begin(), path.end());
+    for (int k = 0; k < (int)path.size(); k++)
+      path[k].parent = k - 1;
+    return path;
+  }
+};
+
+// make count children, each a copy of a random parent A with a random subtree
+// replaced by a random subtree of another parent B. Only pairs of points that
+// keep the child within maxDepth are drawn (the depth of the point in A plus the
+// height of the subtree from B), so no child is built and thrown away; each child
+// costs O(depth + log size) after the per-parent indexes are built. A child for
+// which max_tries draws find no such pair is an unchanged copy of its last A.
+vector<LinkedBinaryTree> batchCrossover(const vector<LinkedBinaryTree> &parents, int count,
+                                        int maxDepth, int generation, long &next_id, mt19937 &rng,
+                                        int max_tries = 16)
+{
+  vector<LinkedBinaryTree> children;
+  vector<CrossoverIndex> index;
+  vector<int> usable; // parents with at least one non-root node
+  for (int i = 0; i < (int)parents.size(); i++)
+  {
+    index.push_back(CrossoverIndex(parents[i]));
+    if (!index.back().points.empty())
+      usable.push_back(i);
+  }
+  if (usable.size() < 2)
+    return children;
+
+  int tries = 0; // for the current child
+  while ((int)children.size() < count)
+  {
+    int a = usable[randInt(rng, 0, usable.size() - 1)];
+    int b = usable[randInt(rng, 0, usable.size() - 2)];
+    if (b == a)
+      b = usable.back(); // draw b from the usable parents other than a
+    const CrossoverIndex &A = index[a];
+    const CrossoverIndex &B = index[b];
+
+    int point = A.points[randInt(rng, 0, A.points.size() - 1)];
+    int room = maxDepth - A.slots[point].depth;
+    // number of subtrees of B that are low enough to fit
+    int fit = upper_bound(B.byHeight.begin(), B.byHeight.end(), room,
+                          [&B](int r, int slot)
+                          { return r < B.height[slot]; }) -
+              B.byHeight.begin();
+    if (fit == 0 && ++tries < max_tries)
+      continue; // only if A is already deeper than maxDepth
+    tries = 0;
+
+    LinkedBinaryTree child(parents[a]);
+    child.setGeneration(generation);
+    if (fit == 0)
+    {
+      child.setBirth(next_id++, BORN_MUTATION, parents[a].getId()); // that changed nothing
+      children.push_back(child);
+      continue;
+    }
+    int donor = B.byHeight[randInt(rng, 0, fit - 1)];
+    LinkedBinaryTree::SlotList path = A.pathTo(point);
+    child.replaceSubtree(path, path.size() - 1, B.slots[donor].v);
+    child.setBirth(next_id++, BORN_CROSSOVER, parents[a].getId(), parents[b].getId());
+    children.push_back(child);
+  }
+  return children;
+}
+
+// steady-state GA without generations: num_threads workers each repeatedly pick
+// a parent by tournament, make a child by crossover with a second tournament
+// winner or by mutation, evaluate it and put it in place of the loser of a
+// reverse tournament if it scores higher. Members are locked one at a time and
+// only to copy or replace them, so no worker waits for another's evaluation.
+// After every report_every evaluations the best member is printed as a CSV line
+// like main's, its first column counting reports. Children are given ids from
+// first_id on. Returns the best tree.
+LinkedBinaryTree runSteadyState(vector<LinkedBinaryTree> population, int num_threads,
+                                long max_evaluations, long report_every, int num_episode,
+                                int max_depth, bool partially_observable, bool use_crossover,
+                                unsigned seed, long first_id, int tournament_size = 3)
+{
+  struct Member
+  {
+    mutex lock;
+    LinkedBinaryTree tree;
+  };
+  vector<Member> members(population.size());
+  for (size_t i = 0; i < population.size(); i++)
+    members[i].tree = population[i];
+  population.clear();
+
+  auto copyOf = [&](int i)
+  {
+    lock_guard<mutex> hold(members[i].lock);
+    return members[i].tree;
+  };
+  auto scoreOf = [&](int i)
+  {
+    lock_guard<mutex> hold(members[i].lock);
+    return members[i].tree.getScore();
+  };
+  // best (or, with worst, the worst) of tournament_size random members
+  auto tournament = [&](mt19937 &rng, bool worst)
+  {
+    int winner = randInt(rng, 0, members.size() - 1);
+    double winner_score = scoreOf(winner);
+    for (int k = 1; k < tournament_size; k++)
+    {
+      int i = randInt(rng, 0, members.size() - 1);
+      double score = scoreOf(i);
+      if (worst ? score < winner_score : score > winner_score)
+      {
+        winner = i;
+        winner_score = score;
+      }
+    }
+    return winner;
+  };
+
+  mutex report_lock;
+  long next_report = 1;
+  auto report = [&](long done)
+  {
+    lock_guard<mutex> hold(report_lock);
+    for (; next_report * report_every <= done; next_report++)
+    {
+      LinkedBinaryTree best = copyOf(0);
+      for (size_t i = 1; i < members.size(); i++)
+      {
+        LinkedBinaryTree t = copyOf(i);
+        if (best < t)
+          best = t;
+      }
+      std::cout << next_report << "," << best.getScore() << "," << best.getSteps() << ","
+                << best.size() << "," << best.depth() << std::endl;
+    }
+  };
+
+  // run work(id, rng) on num_threads threads, each with its own rng kept
+  // between calls, and wait for all of them to finish
+  vector<mt19937> rngs;
+  for (int id = 0; id < num_threads; id++)
+  {
+    seed_seq seq{seed, unsigned(id)};
+    rngs.emplace_back(seq);
+  }
+  auto onAllThreads = [&](auto work)
+  {
+    vector<thread> threads;
+    for (int id = 1; id < num_threads; id++)
+      threads.push_back(thread([&, id]() { work(id, rngs[id]); }));
+    work(0, rngs[0]);
+    for (auto &t : threads)
+      t.join();
+  };
+
+  // the initial members are all evaluated, shared out among the workers, before
+  // any takes part in a tournament; until then they only have the default score
+  atomic<size_t> next_initial(0);
+  auto evaluateInitial = [&](int, mt19937 &rng)
+  {
+    EvalStats stats;
+    for (size_t i; (i = next_initial++) < members.size();)
+    {
+      LinkedBinaryTree t = copyOf(i);
+      evaluateCompiled(rng, t, num_episode, false, partially_observable, stats);
+      lock_guard<mutex> hold(members[i].lock);
+      members[i].tree = t;
+    }
+  };
+  onAllThreads(evaluateInitial);
+
+  atomic<long> evaluations(0);
+  atomic<long> next_id(first_id); // of the children, shared by all threads
+  auto evolve = [&](int, mt19937 &rng)
+  {
+    EvalStats stats;
+    for (long done; (done = evaluations++) < max_evaluations;)
+    {
+      LinkedBinaryTree child = copyOf(tournament(rng, false));
+      long parent = child.getId();
+      bool crossed = false;
+      if (use_crossover && randDouble(rng) < 0.5)
+      {
+        LinkedBinaryTree other = copyOf(tournament(rng, false));
+        crossed = crossover(child, other, rng, max_depth);
+        if (crossed)
+          child.setBirth(next_id++, BORN_CROSSOVER, parent, other.getId());
+      }
+      if (!crossed)
+      {
+        child.deleteSubtreeMutator(rng);
+        child.addSubtreeMutator(rng, max_depth, partially_observable);
+        child.setBirth(next_id++, BORN_MUTATION, parent);
+      }
+      child.setGeneration(done / report_every + 1);
+      evaluateCompiled(rng, child, num_episode, false, partially_observable, stats);
+
+      int loser = tournament(rng, true);
+      {
+        lock_guard<mutex> hold(members[loser].lock);
+        if (members[loser].tree < child)
+          members[loser].tree = child;
+      }
+      if ((done + 1) % report_every == 0)
+        report(done + 1);
+    }
+  };
+  onAllThreads(evolve);
+  report(max_evaluations);
+
+  LinkedBinaryTree best = members[0].tree;
+  for (auto &m : members)
+    if (best < m.tree)
+      best = m.tree;
+  return best;
+}
+
+// print the summary of the best tree at the end of a run
+void printBestTree(LinkedBinaryTree &best)
+{
+  std::cout << std::endl
+            << "Best tree:" << std::endl;
+  best.printExpression();
+  std::cout << endl;
+  std::cout << "Generation: " << best.getGeneration() << endl;
+  std::cout << "Size: " << best.size() << std::endl;
+  std::cout << "Depth: " << best.depth() << std::endl;
+  std::cout << "Fitness: " << best.getScore() << std::endl;
+}
+
+// warn that mode ignores the flags that are set among flags (value, name)
+void warnIgnored(const char *mode, initializer_list<pair<bool, const char *>> flags)
+{
+  vector<string> ignored;
+  for (auto &flag : flags)
+    if (flag.first)
+      ignored.push_back(flag.second);
+  if (!ignored.empty())
+  {
+    cerr << "Warning: " << mode << " ignores";
+    for (auto &name : ignored)
+      cerr << " " << name;
+    cerr << endl;
   }
 }
 
@@ -815,14 +3798,180 @@ int main()
   // note: if you want to test part 3 or 4, please open the use_crossover
   const bool USE_CROSSOVER = true;
 
+  // share of each generation's children made by depth-aware crossover between
+  // random pairs of survivors, the rest are mutated copies. When above 0 this
+  // replaces the single crossover between two survivors of USE_CROSSOVER; it
+  // has no effect when USE_CROSSOVER is false.
+  const double CROSSOVER_FRACTION = 0.0;
+
+  // reuse the fitness of an earlier tree whose actions on a fixed set of probe
+  // states are identical instead of running NUM_EPISODE new episodes
+  const bool USE_FINGERPRINT_CACHE = false;
+  FitnessCache cache(PARTIALLY_OBSERVABLE);
+
+  // write the diversity of each evaluated generation to DIVERSITY_PATH; it uses
+  // no randomness, so it does not change the run
+  const bool TRACK_DIVERSITY = false;
+  const string DIVERSITY_PATH = "diversity.csv";
+  unique_ptr<PopulationDiversity> diversity;
+  if (TRACK_DIVERSITY)
+    diversity.reset(new PopulationDiversity(DIVERSITY_PATH, cache));
+
+  // predict the fitness of offspring with a k-NN model over earlier trees and
+  // only simulate those that may beat the worst survivor of the previous
+  // generation (predicted within the model's mean error of it or above), plus a
+  // SURROGATE_EXPLORE share of the rest; the others are dropped. Per-generation
+  // accuracy and savings go to SURROGATE_PATH.
+  const bool USE_SURROGATE = false;
+  const double SURROGATE_EXPLORE = 0.1;
+  const string SURROGATE_PATH = "surrogate.csv";
+  SurrogateModel surrogate(cache);
+  unique_ptr<SurrogateReport> surrogate_report;
+  if (USE_SURROGATE)
+    surrogate_report.reset(new SurrogateReport(SURROGATE_PATH));
+  double survival_threshold = -HUGE_VAL; // score of the worst survivor so far
+
+  // evaluate memory-free offspring on their parent's start states, computing
+  // only their own nodes for as long as they act like the parent
+  const bool USE_INCREMENTAL = false;
+  TraceCache traces(PARTIALLY_OBSERVABLE);
+
+  // use interval analysis to skip interpreting trees whose action never changes
+  // and to fold constant subtrees before the episodes are run
+  const bool USE_INTERVAL_ANALYSIS = false;
+
+  // evaluate each tree as a DAG in which repeated pure subtrees are computed once
+  // per step
+  const bool USE_CSE = false;
+  EvalStats eval_stats;
+
+  // profile every evaluated tree node by node and write a per-generation report
+  // of op counts, time, dead code and decisive nodes
+  const bool PROFILE_CONTROLLERS = false;
+  unique_ptr<ControllerProfiler> profiler;
+  if (PROFILE_CONTROLLERS)
+    profiler.reset(new ControllerProfiler("profile_report.txt"));
+
+  // log every tree born in the run (ids, parents, operator, program, fitness) to a
+  // binary file written in the background
+  const bool RECORD_GENEALOGY = false;
+  const string GENEALOGY_PATH = "genealogy.bin";
+  unique_ptr<GenealogyLog> genealogy;
+  if (RECORD_GENEALOGY)
+    genealogy.reset(new GenealogyLog(GENEALOGY_PATH));
+  long next_id = 0;
+
+  // before the GA, enumerate every tree of up to ENUM_MAX_SIZE nodes (0 to skip),
+  // evaluate the behaviourally distinct ones and seed the population with the best
+  const int ENUM_MAX_SIZE = 0;
+  EnumerativeSearch search(PARTIALLY_OBSERVABLE, PARTIALLY_OBSERVABLE);
+  vector<LinkedBinaryTree> seeds;
+  if (ENUM_MAX_SIZE > 0)
+    seeds = search.run(ENUM_MAX_SIZE, NUM_EPISODE, 7, NUM_TREE / 2);
+
+  // after the run, validate the best tree from a VALIDATION_GRID x VALIDATION_GRID
+  // grid and VALIDATION_SAMPLES random start states, writing a per-cell map of
+  // the start box to VALIDATION_MAP
+  const bool VALIDATE_BEST = false;
+  const int VALIDATION_GRID = 100;
+  const long VALIDATION_SAMPLES = 100000;
+  const string VALIDATION_MAP = "validation_map.csv";
+
+  // after the run, write the best tree as a standalone C++ function, a benchmark
+  // that checks it against evaluateExpression and times it, and in compact form
+  // for the gp_controller library
+  const bool EXPORT_CONTROLLER = false;
+  const string CONTROLLER_NAME = "cart_controller";
+  const string CONTROLLER_HEADER = CONTROLLER_NAME + ".h";
+  const string CONTROLLER_BENCH = CONTROLLER_NAME + "_bench.cpp";
+  const string CONTROLLER_PROGRAM = CONTROLLER_NAME + ".gpc";
+
+  // when above 0, run the GA on this many trees kept in POPULATION_PATH rather
+  // than on NUM_TREE trees in memory, and stop after printing the best tree
+  const long OUT_OF_CORE_TREES = 0;
+  const string POPULATION_PATH = "population.bin";
+  if (OUT_OF_CORE_TREES > 0)
+  {
+    // the out-of-core GA only mutates and always evaluates compiled trees
+    warnIgnored("OUT_OF_CORE_TREES", {make_pair(USE_CROSSOVER, "USE_CROSSOVER"),
+                                      make_pair(CROSSOVER_FRACTION > 0, "CROSSOVER_FRACTION"),
+                                      make_pair(USE_FINGERPRINT_CACHE, "USE_FINGERPRINT_CACHE"),
+                                      make_pair(TRACK_DIVERSITY, "TRACK_DIVERSITY"),
+                                      make_pair(USE_SURROGATE, "USE_SURROGATE"),
+                                      make_pair(USE_INCREMENTAL, "USE_INCREMENTAL"),
+                                      make_pair(USE_INTERVAL_ANALYSIS, "USE_INTERVAL_ANALYSIS"),
+                                      make_pair(PROFILE_CONTROLLERS, "PROFILE_CONTROLLERS"),
+                                      make_pair(RECORD_GENEALOGY, "RECORD_GENEALOGY"),
+                                      make_pair(ENUM_MAX_SIZE > 0, "ENUM_MAX_SIZE"),
+                                      make_pair(VALIDATE_BEST, "VALIDATE_BEST"),
+                                      make_pair(EXPORT_CONTROLLER, "EXPORT_CONTROLLER")});
+    std::cout << "generation,fitness,steps,size,depth" << std::endl;
+    LinkedBinaryTree best = runOutOfCore(OUT_OF_CORE_TREES, POPULATION_PATH, MAX_GENERATIONS,
+                                         NUM_EPISODE, MAX_DEPTH_INITIAL, MAX_DEPTH,
+                                         PARTIALLY_OBSERVABLE, 42);
+    printBestTree(best);
+    return 0;
+  }
+
+  // when true, make the initial population on all cores with a TreeGenerator,
+  // ramped half-and-half over depths 1 to MAX_DEPTH_INITIAL, whose leaves are a,
+  // b or, with weight ERC_WEIGHT against 1 for each of a and b, a constant in
+  // [-1, 1]. Mutation keeps drawing from the standard table.
+  const bool PARALLEL_INIT = false;
+  const double ERC_WEIGHT = 0.5;
+
   // Create an initial "population" of expression trees
   vector<LinkedBinaryTree> trees;
+  vector<LinkedBinaryTree> generated;
+  if (PARALLEL_INIT)
+  {
+    TreeGenerator generator = TreeGenerator::standard(PARTIALLY_OBSERVABLE);
+    generator.addConstant(ERC_WEIGHT, -1.0, 1.0);
+    generator.fill(generated, NUM_TREE, TreeGenerator::RAMPED, 1, MAX_DEPTH_INITIAL, 42);
+  }
   for (int i = 0; i < NUM_TREE; i++)
   {
-    LinkedBinaryTree t = createRandExpressionTree(MAX_DEPTH_INITIAL, rng, PARTIALLY_OBSERVABLE);
+    LinkedBinaryTree t = PARALLEL_INIT ? generated[i]
+                                       : createRandExpressionTree(MAX_DEPTH_INITIAL, rng,
+                                                                  PARTIALLY_OBSERVABLE);
+    t.setBirth(next_id++, BORN_RANDOM);
+    if (i < (int)seeds.size())
+    {
+      t = seeds[i];
+      t.setBirth(next_id - 1, BORN_ENUMERATED);
+      t.setGeneration(0);
+    }
     trees.push_back(t);
   }
 
+  // when above 0, evolve the initial population with a steady-state GA on this
+  // many threads instead of the generational loop below, for the same number of
+  // evaluations and printing a CSV line per NUM_TREE / 2 of them
+  const int STEADY_STATE_THREADS = 0;
+  if (STEADY_STATE_THREADS > 0)
+  {
+    // the steady-state GA mutates, crosses over with USE_CROSSOVER and always
+    // evaluates compiled trees
+    warnIgnored("STEADY_STATE_THREADS",
+                {make_pair(CROSSOVER_FRACTION > 0, "CROSSOVER_FRACTION"),
+                 make_pair(USE_FINGERPRINT_CACHE, "USE_FINGERPRINT_CACHE"),
+                 make_pair(TRACK_DIVERSITY, "TRACK_DIVERSITY"),
+                 make_pair(USE_SURROGATE, "USE_SURROGATE"),
+                 make_pair(USE_INCREMENTAL, "USE_INCREMENTAL"),
+                 make_pair(USE_INTERVAL_ANALYSIS, "USE_INTERVAL_ANALYSIS"),
+                 make_pair(PROFILE_CONTROLLERS, "PROFILE_CONTROLLERS"),
+                 make_pair(RECORD_GENEALOGY, "RECORD_GENEALOGY"),
+                 make_pair(VALIDATE_BEST, "VALIDATE_BEST"),
+                 make_pair(EXPORT_CONTROLLER, "EXPORT_CONTROLLER")});
+    std::cout << "generation,fitness,steps,size,depth" << std::endl;
+    LinkedBinaryTree best = runSteadyState(trees, STEADY_STATE_THREADS,
+                                           (long)MAX_GENERATIONS * (NUM_TREE / 2), NUM_TREE / 2,
+                                           NUM_EPISODE, MAX_DEPTH, PARTIALLY_OBSERVABLE,
+                                           USE_CROSSOVER, 42, next_id);
+    printBestTree(best);
+    return 0;
+  }
+
   // Genetic Algorithm loop
   LinkedBinaryTree best_tree;
   std::cout << "generation,fitness,steps,size,depth" << std::endl;
@@ -830,12 +3979,90 @@ int main()
   {
 
     // Fitness evaluation
+    if (PROFILE_CONTROLLERS)
+      profiler->beginGeneration(g);
+    unordered_set<long> dropped; // ids of offspring the surrogate did not simulate
     for (auto &t : trees)
     {
       if (t.getGeneration() < g - 1)
         continue; // skip if not new
-      evaluate(rng, t, NUM_EPISODE, false, PARTIALLY_OBSERVABLE);
+      string fp;
+      if (USE_FINGERPRINT_CACHE)
+      {
+        fp = cache.fingerprint(t);
+        if (cache.lookup(fp, t))
+        {
+          if (RECORD_GENEALOGY)
+            genealogy->record(t);
+          continue;
+        }
+      }
+      SurrogateModel::Features features;
+      double prediction = 0;
+      bool predicted = false, exploring = false;
+      if (USE_SURROGATE)
+      {
+        features = surrogate.features(t);
+        predicted = g > 1 && surrogate.ready();
+        if (predicted)
+        {
+          prediction = surrogate.predict(features);
+          if (prediction + surrogate.meanError() < survival_threshold)
+          {
+            exploring = randDouble(rng) < SURROGATE_EXPLORE;
+            if (!exploring)
+            {
+              dropped.insert(t.getId());
+              surrogate_report->skip();
+              if (RECORD_GENEALOGY)
+                genealogy->record(t, false);
+              continue;
+            }
+          }
+        }
+      }
+      // what the cache needs to replay the episodes of a tree with memory
+      mt19937 rng_before;
+      LinkedBinaryTree unevaluated;
+      if (USE_FINGERPRINT_CACHE && t.usesMemory())
+      {
+        rng_before = rng;
+        unevaluated = t;
+      }
+      if (USE_INCREMENTAL && !t.usesMemory())
+        traces.evaluate(rng, t, NUM_EPISODE);
+      else if (PROFILE_CONTROLLERS)
+        evaluateProfiled(rng, t, NUM_EPISODE, false, PARTIALLY_OBSERVABLE, *profiler);
+      else if (USE_INTERVAL_ANALYSIS)
+        evaluateAnalyzed(rng, t, NUM_EPISODE, false, PARTIALLY_OBSERVABLE, eval_stats, USE_CSE);
+      else if (USE_CSE)
+        evaluateCompiled(rng, t, NUM_EPISODE, false, PARTIALLY_OBSERVABLE, eval_stats);
+      else
+        evaluate(rng, t, NUM_EPISODE, false, PARTIALLY_OBSERVABLE);
+      if (USE_FINGERPRINT_CACHE)
+        cache.insert(fp, unevaluated, t, rng_before, NUM_EPISODE);
+      if (USE_SURROGATE)
+      {
+        surrogate.add(features, t.getScore());
+        if (predicted)
+          surrogate.addError(prediction, t.getScore());
+        surrogate_report->simulate(exploring, predicted, prediction, t.getScore(), survival_threshold);
+      }
+      if (RECORD_GENEALOGY)
+        genealogy->record(t);
+    }
+    if (USE_SURROGATE)
+    {
+      surrogate_report->end(g);
+      trees.erase(std::remove_if(trees.begin(), trees.end(),
+                                 [&](const LinkedBinaryTree &t)
+                                 { return dropped.count(t.getId()) > 0; }),
+                  trees.end());
     }
+    if (PROFILE_CONTROLLERS)
+      profiler->report();
+    if (TRACK_DIVERSITY)
+      diversity->record(g, trees);
 
     // sort trees using overloaded "<" op (worst->best)
     std::sort(trees.begin(), trees.end());
@@ -843,8 +4070,12 @@ int main()
     // // sort trees using comparaor class (worst->best)
     // std::sort(trees.begin(), trees.end(), LexLessThan());
 
-    // erase worst 50% of trees (first half of vector)
-    trees.erase(trees.begin(), trees.begin() + NUM_TREE / 2);
+    // erase worst 50% of trees (first half of vector), or fewer when the
+    // surrogate has already dropped some
+    trees.erase(trees.begin(), trees.begin() + (trees.size() - NUM_TREE / 2));
+    survival_threshold = trees[0].getScore();
+    if (USE_INCREMENTAL)
+      traces.keep(trees);
 
     // Print stats for best tree
     best_tree = trees[trees.size() - 1];
@@ -854,14 +4085,33 @@ int main()
     std::cout << best_tree.size() << ",";
     std::cout << best_tree.depth() << std::endl;
 
-    if (USE_CROSSOVER)
+    if (USE_CROSSOVER && CROSSOVER_FRACTION > 0)
+    {
+      int num_children = NUM_TREE - trees.size();
+      vector<LinkedBinaryTree> children =
+          batchCrossover(trees, lround(CROSSOVER_FRACTION * num_children), MAX_DEPTH, g, next_id, rng);
+      for (auto &child : children)
+        trees.push_back(child);
+    }
+    if (USE_CROSSOVER && CROSSOVER_FRACTION <= 0)
     {
       if (randDouble(rng) < 0.5) // set 0.5 for the possibility of crossover
       {
         int idx1 = randInt(rng, 0, trees.size() - 1);
         int idx2 = randInt(rng, 0, trees.size() - 1);
-        if (idx1 != idx2)
-          crossover(trees[idx1], trees[idx2], rng, MAX_DEPTH);
+        if (idx1 != idx2 && crossover(trees[idx1], trees[idx2], rng, MAX_DEPTH))
+        {
+          // both survivors are replaced by new trees; they keep their parents'
+          // scores and are not evaluated again, so they are logged without one
+          long id1 = trees[idx1].getId(), id2 = trees[idx2].getId();
+          trees[idx1].setBirth(next_id++, BORN_CROSSOVER, id1, id2);
+          trees[idx2].setBirth(next_id++, BORN_CROSSOVER, id2, id1);
+          if (RECORD_GENEALOGY)
+          {
+            genealogy->record(trees[idx1], false, g);
+            genealogy->record(trees[idx2], false, g);
+          }
+        }
       }
       // Selection and mutation
       while (trees.size() < NUM_TREE)
@@ -872,6 +4122,7 @@ int main()
         // Create child tree with copy constructor
         LinkedBinaryTree child(parent);
         child.setGeneration(g);
+        child.setBirth(next_id++, BORN_MUTATION, parent.getId());
 
         // Mutation
         // Delete a randomly selected part of the child's tree
@@ -893,6 +4144,7 @@ int main()
         // Create child tree with copy constructor
         LinkedBinaryTree child(parent);
         child.setGeneration(g);
+        child.setBirth(next_id++, BORN_MUTATION, parent.getId());
 
         // Mutation
         // Delete a randomly selected part of the child's tree
@@ -905,18 +4157,131 @@ int main()
     }
   }
 
+  if (RECORD_GENEALOGY)
+  {
+    // the children of the last generation are never evaluated
+    for (auto &t : trees)
+      if (t.getGeneration() == MAX_GENERATIONS)
+        genealogy->record(t, false);
+  }
+
   // // Evaluate best tree with animation
   // const int num_episode = 3;
   // evaluate(rng, best_tree, num_episode, true, PARTIALLY_OBSERVABLE);
 
   // Print best tree info
-  std::cout << std::endl
-            << "Best tree:" << std::endl;
-  best_tree.printExpression();
-  std::cout << endl;
-  std::cout << "Generation: " << best_tree.getGeneration() << endl;
-  std::cout << "Size: " << best_tree.size() << std::endl;
-  std::cout << "Depth: " << best_tree.depth() << std::endl;
-  std::cout << "Fitness: " << best_tree.getScore() << std::endl
-            << std::endl;
-}
\ No newline at end of file
+  printBestTree(best_tree);
+  std::cout << std::endl;
+
+  if (RECORD_GENEALOGY)
+  {
+    long records = genealogy->getRecords();
+    genealogy.reset(); // finish writing the log
+    vector<GenealogyRecord> lineage = traceLineage(GENEALOGY_PATH, best_tree.getId());
+    std::cout << "Genealogy: " << records << " trees logged to " << GENEALOGY_PATH
+              << ", best tree has " << std::max<long>(0, lineage.size() - 1)
+              << " ancestors" << std::endl;
+    static const char *origins[] = {"random", "mutation", "crossover", "enumerated"};
+    for (auto &r : lineage)
+      std::cout << "  tree " << r.id << " (generation " << r.generation << ", "
+                << origins[r.origin] << ", fitness " << r.fitness << ")" << std::endl;
+  }
+  if (VALIDATE_BEST)
+  {
+    ValidationStats grid, random;
+    validateController(best_tree, PARTIALLY_OBSERVABLE, VALIDATION_GRID, VALIDATION_SAMPLES, 7,
+                       VALIDATION_MAP, grid, random);
+    const char *names[] = {"grid", "random"};
+    const ValidationStats *sets[] = {&grid, &random};
+    for (int i = 0; i < 2; i++)
+    {
+      pair<double, double> ci = sets[i]->successInterval();
+      std::cout << "Validation on " << sets[i]->episodes << " " << names[i] << " starts: success "
+                << 100 * sets[i]->successRate() << "% (95% CI " << 100 * ci.first << "-"
+                << 100 * ci.second << "%), mean steps " << sets[i]->meanSteps() << " +- "
+                << sets[i]->stepsHalfWidth() << ", mean reward "
+                << sets[i]->reward / max(1L, sets[i]->episodes) << ", "
+                << sets[i]->excluded << " terminal starts excluded" << std::endl;
+    }
+    std::cout << "Per-cell map in " << VALIDATION_MAP << std::endl;
+  }
+  if (EXPORT_CONTROLLER)
+  {
+    ofstream header(CONTROLLER_HEADER);
+    exportController(best_tree, CONTROLLER_NAME, header);
+    ofstream bench(CONTROLLER_BENCH);
+    exportHarness(best_tree, CONTROLLER_NAME, CONTROLLER_HEADER, PARTIALLY_OBSERVABLE, bench);
+    // the compact form, for gp_controller_load
+    ofstream program(CONTROLLER_PROGRAM, ios::binary);
+    program << encodeProgram(best_tree);
+    long mismatches = checkProgram(best_tree, encodeProgram(best_tree), PARTIALLY_OBSERVABLE);
+    if (mismatches != 0)
+      cerr << "Warning: " << CONTROLLER_PROGRAM << " does not evaluate like the best tree ("
+           << mismatches << " mismatches)" << endl;
+    std::cout << "Best tree exported to " << CONTROLLER_HEADER << " and " << CONTROLLER_PROGRAM
+              << ", benchmark in " << CONTROLLER_BENCH << std::endl;
+  }
+  if (USE_SURROGATE)
+  {
+    std::cout << "Surrogate: " << surrogate_report->getSkipped() << " of "
+              << surrogate_report->getOffspring() << " offspring not simulated ("
+              << surrogate_report->getSkipped() * NUM_EPISODE << " episodes saved), "
+              << 100 * surrogate_report->getAccuracy()
+              << "% of survival predictions correct, per generation in " << SURROGATE_PATH << std::endl;
+  }
+  if (TRACK_DIVERSITY)
+    std::cout << "Diversity per generation in " << DIVERSITY_PATH << std::endl;
+  if (USE_INCREMENTAL)
+  {
+    std::cout << "Incremental evaluation: " << traces.getChildren()
+              << " offspring followed a parent's trace for " << traces.getReusedSteps()
+              << " of " << traces.getSteps() << " steps, " << traces.getComputed() << " of "
+              << traces.getTotal() << " node evaluations done" << std::endl;
+  }
+  if (ENUM_MAX_SIZE > 0)
+  {
+    std::cout << "Enumeration up to " << ENUM_MAX_SIZE << " nodes: "
+              << search.getGenerated() << " trees built, "
+              << search.getCanonicalDuplicates() << " canonical duplicates, "
+              << search.getValueDuplicates() << " equal on probes, "
+              << search.getBehaviourDuplicates() << " equal in behaviour, "
+              << search.getEvaluated() << " simulated" << std::endl;
+    if (!seeds.empty())
+    {
+      std::cout << "Best enumerated tree: ";
+      seeds[0].printExpression();
+      std::cout << " (fitness " << seeds[0].getScore() << ")" << std::endl;
+    }
+  }
+  if (PROFILE_CONTROLLERS)
+  {
+    // profile the best tree on its own, without touching its score
+    mt19937 profile_rng(1);
+    LinkedBinaryTree copy(best_tree);
+    TreeProfile p(copy);
+    runEpisodes(profile_rng, copy, p, NUM_EPISODE, false, PARTIALLY_OBSERVABLE);
+    profiler->reportTree("best tree", p);
+    std::cout << "Profile written to profile_report.txt" << std::endl;
+  }
+  if (USE_FINGERPRINT_CACHE)
+  {
+    std::cout << "Fingerprint cache: " << cache.getHits() << " of "
+              << cache.getLookups() << " evaluations reused ("
+              << cache.getVerified() << " with memory verified by replay, "
+              << cache.getRejected() << " replays rejected)" << std::endl;
+  }
+  if (USE_INTERVAL_ANALYSIS)
+  {
+    std::cout << "Interval analysis: " << eval_stats.constant << " of "
+              << eval_stats.trees << " trees have a constant action, "
+              << eval_stats.folded_nodes << " of " << eval_stats.nodes
+              << " nodes folded" << std::endl;
+  }
+  if (USE_CSE)
+  {
+    std::cout << "Common subexpressions: " << eval_stats.instructions
+              << " instructions for " << eval_stats.compiled_nodes << " nodes"
+              << std::endl;
+  }
+  return 0;
+}
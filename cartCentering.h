@@ -19,6 +19,17 @@ inline bool isEqual(double x, double y) { return fabs(x - y) < NEARZERO; }
 /******************************************************************************/
 class cartCentering
 {
+public:
+  // how the state is advanced over one control interval of control_steps * TAU
+  enum Integrator
+  {
+    EULER, // explicit Euler every TAU, terminal conditions checked every TAU
+    EXACT, // closed form of the constant acceleration, crossings of the terminal
+           // conditions found analytically at any time in the interval
+    RK4    // one Runge-Kutta step per interval, its cubic Hermite interpolant
+           // checked for terminal conditions every TAU
+  };
+
 protected:
   // parameters for simulation
   const double MASSCART = 2.0;
@@ -44,13 +55,24 @@ protected:
   std::uniform_real_distribution<> disReset;
   bool draw_track = false;
 
+  Integrator integrator;
+  int control_steps; // TAU steps per call to update
+
 public:
   /************************************************************************/
-  cartCentering()
+  cartCentering(Integrator i = EULER, int steps = 1)
   {
     disReset = std::uniform_real_distribution<>(MIN_VAR_INI, MAX_VAR_INI);
     max_step = 500;
     state.resize(STATE_SIZE);
+    setIntegrator(i, steps);
+  }
+
+  /************************************************************************/
+  void setIntegrator(Integrator i, int steps)
+  {
+    integrator = i;
+    control_steps = std::max(1, steps);
   }
 
   /************************************************************************/
@@ -67,6 +89,14 @@ public:
     } while (terminal());
   }
 
+  /************************************************************************/
+  void reset(double x, double v, int s = 0)
+  {
+    step = s;
+    state[X] = x;
+    state[V] = v;
+  }
+
   /************************************************************************/
   bool terminal()
   {
@@ -80,15 +110,28 @@ public:
   }
 
   /************************************************************************/
+  // apply the action for one control interval, or until a terminal state.
+  // step counts TAU intervals whatever the integrator.
   double update(const int &action, bool animate = false)
   {
     double force = action < 0 ? -FORCE_MAG : FORCE_MAG;
     double acc_t = force / MASSCART;
+    int steps = std::min(control_steps, max_step - step);
 
-    state[X] += TAU * state[V];
-    state[V] += TAU * acc_t;
-    state[V] = bound(state[V], -MAX_V, MAX_V);
-    step++;
+    if (integrator == EXACT)
+      advanceExact(acc_t, steps);
+    else if (integrator == RK4)
+      advanceRK4(acc_t, steps);
+    else
+    {
+      for (int i = 0; i < steps && (i == 0 || !terminal()); i++)
+      {
+        state[X] += TAU * state[V];
+        state[V] += TAU * acc_t;
+        state[V] = bound(state[V], -MAX_V, MAX_V);
+        step++;
+      }
+    }
     if (animate)
       draw(action);
     if (terminal())
@@ -107,8 +150,153 @@ public:
   {
     return std::min(std::max(x, m), M);
   }
+  /************************************************************************/
+  // advance steps * TAU with constant acceleration acc, stopping at the first
+  // time a terminal condition holds
+  void advanceExact(double acc, int steps)
+  {
+    double duration = steps * TAU;
+    // accelerate until the speed limit, then coast at it
+    double limit = acc > 0 ? MAX_V : -MAX_V;
+    double accelerating = (limit - state[V]) / acc;
+    double phases[2][2] = {{acc, std::min(duration, std::max(0.0, accelerating))},
+                           {0.0, duration - std::min(duration, std::max(0.0, accelerating))}};
+    double elapsed = 0;
+    for (auto &phase : phases)
+    {
+      double a = phase[0], t = phase[1];
+      if (t <= 0)
+        continue;
+      double x = state[X], v = state[V];
+      bool near = false;
+      double hit = firstTerminal(x, v, a, t, near);
+      double dt = hit >= 0 ? hit : t;
+      state[X] = x + v * dt + 0.5 * a * dt * dt;
+      state[V] = bound(v + a * dt, -MAX_V, MAX_V);
+      elapsed += dt;
+      if (hit >= 0)
+      {
+        // the crossing point itself, placed on the terminal side
+        if (near)
+        {
+          state[X] = bound(state[X], -NEAR_ORIGIN, NEAR_ORIGIN);
+          state[V] = bound(state[V], -NEAR_ORIGIN, NEAR_ORIGIN);
+        }
+        else
+          state[X] = std::copysign(std::nextafter(MAX_X, 2 * MAX_X), state[X]);
+        step += std::max(1, (int)std::ceil(elapsed / TAU - 1e-9));
+        return;
+      }
+    }
+    if (std::abs(state[V]) > MAX_V - 1e-12)
+      state[V] = std::copysign(MAX_V, state[V]);
+    step += steps;
+  }
+
+  // earliest time in (0, t] at which x + v s + a s^2 / 2 leaves [-MAX_X, MAX_X]
+  // or the state enters the NEAR_ORIGIN box, -1 if none; near tells which
+  double firstTerminal(double x, double v, double a, double t, bool &near)
+  {
+    double first = -1;
+    auto consider = [&](double s, bool is_near)
+    {
+      if (s > 0 && s <= t && (first < 0 || s < first))
+      {
+        first = s;
+        near = is_near;
+      }
+    };
+    double roots[2];
+    for (double edge : {-MAX_X, MAX_X})
+      for (int i = 0, n = solve(a / 2, v, x - edge, roots); i < n; i++)
+        consider(roots[i], false);
+
+    // times at which |v| <= NEAR_ORIGIN
+    double lo = 0, hi = t;
+    if (a == 0)
+    {
+      if (std::abs(v) > NEAR_ORIGIN)
+        return first;
+    }
+    else
+    {
+      lo = std::max(lo, std::min((-NEAR_ORIGIN - v) / a, (NEAR_ORIGIN - v) / a));
+      hi = std::min(hi, std::max((-NEAR_ORIGIN - v) / a, (NEAR_ORIGIN - v) / a));
+    }
+    // |x| <= NEAR_ORIGIN starts at lo or where x crosses an edge of the box
+    double candidates[5] = {lo};
+    int num_candidates = 1;
+    for (double edge : {-NEAR_ORIGIN, NEAR_ORIGIN})
+      for (int i = 0, n = solve(a / 2, v, x - edge, roots); i < n; i++)
+        candidates[num_candidates++] = roots[i];
+    for (int i = 0; i < num_candidates; i++)
+    {
+      double s = candidates[i];
+      double xs = x + v * s + 0.5 * a * s * s;
+      if (s >= lo && s <= hi && std::abs(xs) <= NEAR_ORIGIN * (1 + 1e-9))
+        consider(std::max(s, 1e-12), true);
+    }
+    return first;
+  }
+
+  // real roots of p s^2 + q s + r = 0, in increasing order
+  int solve(double p, double q, double r, double *roots)
+  {
+    if (p == 0)
+    {
+      if (q == 0)
+        return 0;
+      roots[0] = -r / q;
+      return 1;
+    }
+    double d = q * q - 4 * p * r;
+    if (d < 0)
+      return 0;
+    // the form that avoids cancellation
+    double w = -0.5 * (q + std::copysign(std::sqrt(d), q));
+    double s1 = w / p, s2 = w != 0 ? r / w : s1;
+    roots[0] = std::min(s1, s2);
+    roots[1] = std::max(s1, s2);
+    return 2;
+  }
+
+  // advance steps * TAU with one RK4 step, stopping at the first TAU at which
+  // the interpolated state is terminal
+  void advanceRK4(double acc, int steps)
+  {
+    double h = steps * TAU;
+    // acceleration is cut off at the speed limit
+    auto dv = [&](double v)
+    { return (v >= MAX_V && acc > 0) || (v <= -MAX_V && acc < 0) ? 0.0 : acc; };
+    double x0 = state[X], v0 = state[V];
+    double k1x = v0, k1v = dv(v0);
+    double k2x = v0 + h / 2 * k1v, k2v = dv(v0 + h / 2 * k1v);
+    double k3x = v0 + h / 2 * k2v, k3v = dv(v0 + h / 2 * k2v);
+    double k4x = v0 + h * k3v, k4v = dv(v0 + h * k3v);
+    double x1 = x0 + h / 6 * (k1x + 2 * k2x + 2 * k3x + k4x);
+    double v1 = bound(v0 + h / 6 * (k1v + 2 * k2v + 2 * k3v + k4v), -MAX_V, MAX_V);
+    for (int i = 1; i <= steps; i++)
+    {
+      double s = double(i) / steps;
+      double h00 = (1 + 2 * s) * (1 - s) * (1 - s), h10 = s * (1 - s) * (1 - s);
+      double h01 = s * s * (3 - 2 * s), h11 = s * s * (s - 1);
+      state[X] = h00 * x0 + h10 * h * v0 + h01 * x1 + h11 * h * v1;
+      state[V] = v0 + s * (v1 - v0);
+      step++;
+      if (terminal())
+        return;
+    }
+  }
+
+  int getStep() const { return step; }
+  int getControlSteps() const { return control_steps; }
   double getCartXPos() { return state[X]; }
   double getCartXVel() { return state[V]; }
+  double getMaxX() const { return MAX_X; }
+  double getMaxV() const { return MAX_V; }
+  double getMinVarIni() const { return MIN_VAR_INI; }
+  double getMaxVarIni() const { return MAX_VAR_INI; }
+  double getNearOrigin() const { return NEAR_ORIGIN; }
   void setDraw(bool d) { draw_track = d; }
 
   /************************************************************************/
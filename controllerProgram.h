@@ -0,0 +1,255 @@
+#ifndef controllerProgram_h
+#define controllerProgram_h
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <cmath>
+#include <vector>
+
+// operations a node can hold; OP_A, OP_B and OP_CONST are only used for leaves
+enum Opcode
+{
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_GT,
+  OP_ABS,
+  OP_READ,
+  OP_WRITE,
+  OP_A,
+  OP_B,
+  OP_CONST,
+  OP_UNKNOWN
+};
+
+// number of cells behind read and write
+const int MEMORY_CELLS = 4;
+
+// compact binary form of a tree: one byte per node in preorder holding the opcode
+// and which children the node has, followed by the 8-byte value of a constant
+const unsigned char HAS_LEFT = 0x40;
+const unsigned char HAS_RIGHT = 0x20;
+const unsigned char OPCODE_MASK = 0x1f;
+
+/******************************************************************************/
+// the result of operation op on x and y. read returns the mean of the memory
+// cells, write sets them all to x; inf and nan results become 0.
+inline double applyOp(Opcode op, double x, double y, double *memory)
+{
+  double result;
+  switch (op)
+  {
+  case OP_ADD:
+    result = x + y;
+    break;
+  case OP_SUB:
+    result = x - y;
+    break;
+  case OP_MUL:
+    result = x * y;
+    break;
+  case OP_DIV:
+    result = x / y;
+    break;
+  case OP_GT:
+    result = x > y ? 1 : -1;
+    break;
+  case OP_ABS:
+    result = std::abs(x);
+    break;
+  case OP_READ:
+  {
+    double sum = 0;
+    for (int i = 0; i < MEMORY_CELLS; i++)
+      sum += memory[i];
+    result = sum / MEMORY_CELLS;
+    break;
+  }
+  case OP_WRITE:
+    for (int i = 0; i < MEMORY_CELLS; i++)
+      memory[i] = x;
+    result = x;
+    break;
+  default:
+    result = 0;
+  }
+  return std::isnan(result) || !std::isfinite(result) ? 0 : result;
+}
+
+/******************************************************************************/
+// one instruction of a flattened tree, as run by ControllerProgram and by the
+// GP's CompiledTree: operands are the values of earlier instructions
+struct ProgramInstr
+{
+  Opcode op;
+  int left;     // index of the first operand, -1 if none
+  int right;    // index of the second operand, -1 if none
+  double value; // value of an OP_CONST leaf
+};
+
+// the value of instruction in given its operands' values x and y (0 if absent),
+// the observation a, b and the memory cells
+inline double executeInstr(const ProgramInstr &in, double x, double y, double a, double b,
+                           double *memory)
+{
+  switch (in.op)
+  {
+  case OP_A:
+    return a;
+  case OP_B:
+    return b;
+  case OP_CONST:
+    return in.value;
+  default:
+    return applyOp(in.op, x, y, memory);
+  }
+}
+
+/******************************************************************************/
+// a controller decoded from its compact form into postorder instructions, run
+// by executeInstr like the GP's own compiled trees. Evaluation allocates nothing
+// after the first batch of a thread, and a program can be shared between threads.
+class ControllerProgram
+{
+public:
+  typedef ProgramInstr Instr;
+
+  // decode the program in data[0, length), return false if it is malformed
+  bool load(const unsigned char *data, size_t length)
+  {
+    code.clear();
+    writes = false;
+    reads = false;
+    size_t pos = 0;
+    if (length == 0 || decode(data, length, pos, 0) < 0 || pos != length)
+    {
+      code.clear();
+      return false;
+    }
+    return true;
+  }
+
+  size_t size() const { return code.size(); }
+  bool usesMemory() const { return reads || writes; }
+  const std::vector<Instr> &instructions() const { return code; }
+
+  // value for one observation; memory holds MEMORY_CELLS cells
+  double evaluate(double a, double b, double *memory) const
+  {
+    double cells[MEMORY_CELLS] = {0, 0, 0, 0};
+    const double *in[2] = {&a, &b};
+    double out;
+    run(1, in, 0, memory != NULL ? memory : cells, &out);
+    return out;
+  }
+
+  // values for n observations a[i * a_stride], b[i * b_stride] (b may be NULL,
+  // then 0) into out[i]. Row i reads and writes its own MEMORY_CELLS cells at
+  // memory + i * MEMORY_CELLS; with memory NULL every row starts from zeroed
+  // cells. Rows are processed in tiles, one instruction across a tile at a time.
+  void evaluate(size_t n, const double *a, size_t a_stride, const double *b, size_t b_stride,
+                double *memory, double *out) const
+  {
+    static thread_local std::vector<double> scratch;
+    for (size_t begin = 0; begin < n; begin += TILE)
+    {
+      size_t rows = n - begin < TILE ? n - begin : TILE;
+      double as[TILE], bs[TILE];
+      for (size_t r = 0; r < rows; r++)
+      {
+        as[r] = a[(begin + r) * a_stride];
+        bs[r] = b != NULL ? b[(begin + r) * b_stride] : 0.0;
+      }
+      double *cells = memory != NULL ? memory + begin * MEMORY_CELLS : NULL;
+      if (cells == NULL && usesMemory())
+      {
+        scratch.assign(rows * MEMORY_CELLS, 0.0);
+        cells = scratch.data();
+      }
+      const double *in[2] = {as, bs};
+      run(rows, in, 1, cells, out + begin);
+    }
+  }
+
+private:
+  static const size_t TILE = 64;
+
+  // append the instructions of the subtree at data[pos], return the index of its
+  // value or -1 if the data is malformed
+  int decode(const unsigned char *data, size_t length, size_t &pos, int depth)
+  {
+    if (pos >= length || depth > MAX_DEPTH)
+      return -1;
+    unsigned char byte = data[pos++];
+    Instr in = {Opcode(byte & OPCODE_MASK), -1, -1, 0.0};
+    if (in.op >= OP_UNKNOWN)
+      return -1;
+    if (in.op == OP_CONST)
+    {
+      if (length - pos < sizeof(double))
+        return -1;
+      memcpy(&in.value, data + pos, sizeof(double));
+      pos += sizeof(double);
+    }
+    int left = -1, right = -1;
+    if (byte & HAS_LEFT)
+      left = decode(data, length, pos, depth + 1);
+    if (byte & HAS_RIGHT)
+      right = decode(data, length, pos, depth + 1);
+    if (((byte & HAS_LEFT) && left < 0) || ((byte & HAS_RIGHT) && right < 0))
+      return -1;
+    bool leaf = !(byte & (HAS_LEFT | HAS_RIGHT));
+    if (!leaf)
+    {
+      // an inner node takes its left value, and its right one if binary; a
+      // unary node ignores a right child
+      bool unary = in.op == OP_ABS || in.op == OP_WRITE || in.op == OP_READ;
+      if (left < 0 || (!unary && right < 0) || in.op >= OP_A)
+        return -1;
+      in.left = left;
+      in.right = unary ? -1 : right;
+    }
+    reads = reads || in.op == OP_READ;
+    writes = writes || in.op == OP_WRITE;
+    code.push_back(in);
+    return code.size() - 1;
+  }
+
+  // evaluate rows observations: in[0][r * step], in[1][r * step] are a and b of
+  // row r (step 0 repeats the first), with cells for each row
+  void run(size_t rows, const double *const in[2], size_t step, double *memory, double *out) const
+  {
+    static thread_local std::vector<double> regs;
+    if (code.empty())
+    {
+      for (size_t k = 0; k < rows; k++)
+        out[k] = 0.0;
+      return;
+    }
+    if (regs.size() < code.size() * rows)
+      regs.resize(code.size() * rows);
+    for (size_t i = 0; i < code.size(); i++)
+    {
+      const Instr &c = code[i];
+      double *r = &regs[i * rows];
+      const double *x = c.left >= 0 ? &regs[c.left * rows] : NULL;
+      const double *y = c.right >= 0 ? &regs[c.right * rows] : NULL;
+      for (size_t k = 0; k < rows; k++)
+        r[k] = executeInstr(c, x != NULL ? x[k] : 0.0, y != NULL ? y[k] : 0.0,
+                            in[0][k * step], in[1][k * step],
+                            memory != NULL ? memory + k * MEMORY_CELLS : NULL);
+    }
+    const double *root = &regs[(code.size() - 1) * rows];
+    for (size_t k = 0; k < rows; k++)
+      out[k] = root[k];
+  }
+
+  static const int MAX_DEPTH = 4096; // of a tree that load accepts
+  std::vector<Instr> code;
+  bool reads = false;
+  bool writes = false;
+};
+#endif
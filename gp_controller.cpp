@@ -0,0 +1,117 @@
+// C interface of gp_controller.h over ControllerProgram and cartCentering
+
+#include <new>
+#include <random>
+
+#include "cartCentering.h"
+#include "controllerProgram.h"
+#include "gp_controller.h"
+
+struct gp_controller
+{
+  ControllerProgram program;
+};
+
+// the environment the cart functions step each cart with, one per thread so
+// that its state vector is only allocated on a thread's first call
+static cartCentering &threadEnv()
+{
+  static thread_local cartCentering env;
+  return env;
+}
+
+int gp_abi_version(void) { return GP_CONTROLLER_ABI_VERSION; }
+
+gp_controller *gp_controller_load(const unsigned char *program, size_t length)
+{
+  if (program == NULL)
+    return NULL;
+  gp_controller *c = new (std::nothrow) gp_controller;
+  if (c == NULL)
+    return NULL;
+  if (!c->program.load(program, length))
+  {
+    delete c;
+    return NULL;
+  }
+  return c;
+}
+
+void gp_controller_free(gp_controller *controller) { delete controller; }
+
+size_t gp_controller_size(const gp_controller *controller)
+{
+  return controller != NULL ? controller->program.size() : 0;
+}
+
+int gp_controller_uses_memory(const gp_controller *controller)
+{
+  return controller != NULL && controller->program.usesMemory();
+}
+
+int gp_controller_evaluate(const gp_controller *controller, size_t n,
+                           const double *a, size_t a_stride,
+                           const double *b, size_t b_stride,
+                           double *memory, double *values, int *actions)
+{
+  if (controller == NULL || (a == NULL && n > 0))
+    return -1;
+  // values go to the caller's buffer if given, else through a small one
+  const size_t CHUNK = 256;
+  double chunk[CHUNK];
+  for (size_t begin = 0; begin < n;)
+  {
+    size_t rows = values != NULL ? n : std::min(CHUNK, n - begin);
+    double *out = values != NULL ? values : chunk;
+    controller->program.evaluate(rows, a + begin * a_stride, a_stride,
+                                 b != NULL ? b + begin * b_stride : NULL, b_stride,
+                                 memory != NULL ? memory + begin * GP_MEMORY_CELLS : NULL, out);
+    // the GP's action is int(value) < 0, i.e. value <= -1
+    if (actions != NULL)
+      for (size_t i = 0; i < rows; i++)
+        actions[begin + i] = out[i] <= -1.0 ? -1 : 1;
+    begin += rows;
+  }
+  return 0;
+}
+
+void gp_env_reset(size_t n, double *state, int *steps, uint64_t seed)
+{
+  std::mt19937 rng(seed);
+  cartCentering &env = threadEnv();
+  for (size_t i = 0; i < n; i++)
+  {
+    env.reset(rng);
+    state[2 * i] = env.getCartXPos();
+    state[2 * i + 1] = env.getCartXVel();
+    if (steps != NULL)
+      steps[i] = 0;
+  }
+}
+
+int gp_env_step(size_t n, double *state, int *steps, const int *actions,
+                int integrator, int control_steps, double *rewards, unsigned char *done)
+{
+  if ((n > 0 && (state == NULL || steps == NULL || actions == NULL)) ||
+      integrator < GP_EULER || integrator > GP_RK4 || control_steps < 1)
+    return -1;
+  cartCentering &env = threadEnv();
+  env.setIntegrator(cartCentering::Integrator(integrator), control_steps);
+  for (size_t i = 0; i < n; i++)
+  {
+    env.reset(state[2 * i], state[2 * i + 1], steps[i]);
+    double reward = 0;
+    if (!env.terminal())
+    {
+      reward = env.update(actions[i]);
+      state[2 * i] = env.getCartXPos();
+      state[2 * i + 1] = env.getCartXVel();
+      steps[i] = env.getStep();
+    }
+    if (rewards != NULL)
+      rewards[i] = reward;
+    if (done != NULL)
+      done[i] = env.terminal();
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef gp_controller_h
+#define gp_controller_h
+
+/* C interface to evolved cart controllers and the cart centering environment,
+ * for simulators that drive many vehicles per tick. All arrays belong to the
+ * caller: inputs are read in place and results are written to the buffers
+ * given, so a batch call copies nothing and, after the first call on a
+ * thread, allocates nothing.
+ * Build the library libgpcontroller.so with
+ *   make libgpcontroller.so
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* incremented when a function changes incompatibly */
+#define GP_CONTROLLER_ABI_VERSION 1
+
+/* number of doubles of controller memory per vehicle */
+#define GP_MEMORY_CELLS 4
+
+/* integrators of gp_env_step */
+#define GP_EULER 0
+#define GP_EXACT 1
+#define GP_RK4 2
+
+  typedef struct gp_controller gp_controller;
+
+  int gp_abi_version(void);
+
+  /* load a controller from its compact program form, as written by the GP next
+   * to an exported controller (the .gpc file) or logged in its genealogy.
+   * Returns NULL if the program is malformed. */
+  gp_controller *gp_controller_load(const unsigned char *program, size_t length);
+  void gp_controller_free(gp_controller *controller);
+
+  /* number of instructions, and whether the controller uses memory */
+  size_t gp_controller_size(const gp_controller *controller);
+  int gp_controller_uses_memory(const gp_controller *controller);
+
+  /* evaluate the controller for n vehicles. Vehicle i observes
+   * a[i * a_stride] and b[i * b_stride]; b may be NULL for 0 (partially
+   * observable). memory holds GP_MEMORY_CELLS doubles per vehicle, read and
+   * updated in place; zero a vehicle's cells at the start of an episode. With
+   * memory NULL every vehicle starts from zeroed cells. values[i] receives the
+   * controller's value and actions[i] the force direction, -1 or 1; either may
+   * be NULL. Safe to call from several threads on one controller. Returns 0,
+   * or -1 for a NULL controller or input. */
+  int gp_controller_evaluate(const gp_controller *controller, size_t n,
+                             const double *a, size_t a_stride,
+                             const double *b, size_t b_stride,
+                             double *memory, double *values, int *actions);
+
+  /* draw random initial states for n carts from seed: state holds x and v of
+   * cart i at state[2 * i] and state[2 * i + 1], and steps[i] is zeroed */
+  void gp_env_reset(size_t n, double *state, int *steps, uint64_t seed);
+
+  /* apply actions[i] to cart i for control_steps steps of the chosen integrator.
+   * Carts already terminal are left alone with reward 0. rewards[i] receives
+   * the step's reward and done[i] whether the cart is now terminal; either may
+   * be NULL. Returns 0, or -1 for bad arguments. */
+  int gp_env_step(size_t n, double *state, int *steps, const int *actions,
+                  int integrator, int control_steps, double *rewards, unsigned char *done);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
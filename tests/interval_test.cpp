@@ -0,0 +1,79 @@
+// checks of the interval analysis against values computed at run time
+// build and run with: make test
+
+#define main gp_main
+#include "../400499564_genetic_programming_01.cpp"
+#undef main
+
+static int failures = 0;
+
+static void check(bool ok, const string &what)
+{
+  if (!ok)
+  {
+    cerr << "FAIL: " << what << endl;
+    failures++;
+  }
+}
+
+static bool contains(const Interval &r, double x) { return r.lo <= x && x <= r.hi; }
+
+static string text(double x)
+{
+  ostringstream out;
+  out << setprecision(17) << x;
+  return out.str();
+}
+
+// the value a read gives when every memory cell holds m
+static double runtimeRead(double m)
+{
+  double cells[MEMORY_CELLS];
+  for (double &c : cells)
+    c = m;
+  return applyOp(OP_READ, 0.0, 0.0, cells);
+}
+
+// every value read returns for memory in [lo, hi] lies in readRange
+static void checkReadRange(double lo, double hi)
+{
+  Interval r = readRange({lo, hi});
+  string name = "read over [" + text(lo) + ", " + text(hi) + "]";
+  for (int i = 0; i <= 64; i++)
+  {
+    double m = lo + (hi - lo) * (i / 64.0);
+    if (!isfinite(m))
+      m = i < 32 ? lo : hi;
+    check(contains(r, runtimeRead(m)), name + " at " + text(m));
+  }
+  for (double m : {lo, nextafter(lo, hi), nextafter(hi, lo), hi})
+    check(contains(r, runtimeRead(m)), name + " at " + text(m));
+}
+
+int main()
+{
+  const double limit = DBL_MAX / MEMORY_CELLS; // largest cells whose sum is finite
+
+  // ranges that do not contain 0 and whose sum overflows in all or part of them
+  checkReadRange(limit / 2, limit);
+  checkReadRange(limit, 2 * limit);
+  checkReadRange(nextafter(limit, 0.0), nextafter(limit, DBL_MAX));
+  checkReadRange(DBL_MAX / 2, DBL_MAX);
+  checkReadRange(-DBL_MAX, -limit / 2);
+  checkReadRange(1.0, 2.0);
+
+  // a single value is computed exactly, overflow included
+  for (double m : {limit, nextafter(limit, DBL_MAX), DBL_MAX, -DBL_MAX, 1.0, 0.0})
+  {
+    Interval r = readRange({m, m});
+    check(r.isPoint() && r.lo == runtimeRead(m), "read of " + text(m));
+  }
+
+  // a read of an overflowing value must not let a comparison be folded away
+  Interval x = readRange({2 * limit, DBL_MAX});
+  check(intervalOp(">", x, {1.0, 1.0}) != Interval{1, 1}, "read > 1 is not always true");
+
+  if (failures == 0)
+    cout << "interval tests passed" << endl;
+  return failures == 0 ? 0 : 1;
+}